@@ -0,0 +1,202 @@
+#include "AsyncLogger.h"
+
+#include <algorithm>
+#include <cstring>
+
+
+namespace {
+    std::size_t ringCapacity(std::size_t capacity) {
+        std::size_t rounded = 2;
+        while (rounded < capacity) {
+            rounded <<= 1;
+        }
+        return rounded;
+    }
+}
+
+AsyncLogger::AsyncLogger(std::filesystem::path const &path) : AsyncLogger(path, Options{}) {
+}
+
+AsyncLogger::AsyncLogger(std::filesystem::path const &path, Options const &options)
+    : options(options),
+      file(path, FileHandler::FileMode::Append, FileHandler::WriteOptions{0, FileHandler::Durability::Never}),
+      mask(ringCapacity(options.capacity) - 1),
+      slots(std::make_unique<Slot[]>(mask + 1)) {
+    for (std::size_t i = 0; i <= mask; ++i) {
+        slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    writer = std::thread([this] {
+        run();
+    });
+}
+
+bool AsyncLogger::log(std::string_view line) {
+    thread_local std::uint64_t calls = 0;
+    if (++calls % ENQUEUE_SAMPLE_EVERY != 0) {
+        return enqueue(line);
+    }
+    auto const start = std::chrono::steady_clock::now();
+    bool const queued = enqueue(line);
+    auto const elapsed = static_cast<std::uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+    enqueue_samples.fetch_add(1, std::memory_order_relaxed);
+    enqueue_total_ns.fetch_add(elapsed, std::memory_order_relaxed);
+    std::uint64_t max = enqueue_max_ns.load(std::memory_order_relaxed);
+    while (elapsed > max && !enqueue_max_ns.compare_exchange_weak(max, elapsed, std::memory_order_relaxed)) {
+    }
+    return queued;
+}
+
+bool AsyncLogger::enqueue(std::string_view line) {
+    std::uint64_t position = tail.load(std::memory_order_relaxed);
+    while (true) {
+        Slot &slot = slots[position & mask];
+        std::uint64_t const sequence = slot.sequence.load(std::memory_order_acquire);
+        if (sequence == position) {
+            if (tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                slot.length = static_cast<std::uint32_t>(line.size());
+                if (line.size() <= INLINE_LINE_SIZE) {
+                    std::memcpy(slot.data, line.data(), line.size());
+                } else {
+                    slot.overflow.assign(line);
+                }
+                slot.sequence.store(position + 1, std::memory_order_release);
+                return true;
+            }
+        } else if (sequence < position) {
+            // The slot still holds the line of the previous lap: the ring is full
+            if (options.overflow == Overflow::Drop) {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            std::this_thread::yield();
+            position = tail.load(std::memory_order_relaxed);
+        } else {
+            position = tail.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+bool AsyncLogger::writeBatch() {
+    std::uint64_t const start = head;
+    std::size_t bytes = 0;
+    batch.clear();
+    while (bytes < options.batch_size && head - start <= mask) {
+        Slot &slot = slots[head & mask];
+        if (slot.sequence.load(std::memory_order_acquire) != head + 1) {
+            break;
+        }
+        batch.emplace_back(slot.length <= INLINE_LINE_SIZE ? std::string_view(slot.data, slot.length)
+                                                           : std::string_view(slot.overflow));
+        bytes += slot.length + 1;
+        ++head;
+    }
+    if (batch.empty()) {
+        return false;
+    }
+
+    // The slots are reused only after the call, so the lines are written without a copy; lines
+    // after a failed write are lost, the earlier ones are in the file
+    std::size_t const lines_written = file.writeLinesDirect(batch);
+    written.fetch_add(lines_written, std::memory_order_relaxed);
+    failed.fetch_add(batch.size() - lines_written, std::memory_order_relaxed);
+    batches.fetch_add(1, std::memory_order_relaxed);
+    for (std::uint64_t position = start; position < head; ++position) {
+        Slot &slot = slots[position & mask];
+        if (slot.length > INLINE_LINE_SIZE) {
+            slot.overflow.clear();
+        }
+        slot.sequence.store(position + mask + 1, std::memory_order_release);
+    }
+    return true;
+}
+
+void AsyncLogger::run() {
+    bool const syncing = options.sync_interval.count() > 0;
+    auto last_sync = std::chrono::steady_clock::now();
+    std::uint64_t synced = 0;
+    // Lines an fdatasync was tried for; a failed one leaves synced behind and is retried an
+    // interval later
+    std::uint64_t attempted = 0;
+    while (true) {
+        bool const wrote = writeBatch();
+        std::unique_lock<std::mutex> lock(mutex);
+        bool const waited_for = flush_requested > done;
+        bool const stop = stopping;
+        lock.unlock();
+
+        // One fdatasync covers every line written since the last one; a waiting flush() or the
+        // close do not wait for the interval once the ring is drained
+        auto const now = std::chrono::steady_clock::now();
+        if (syncing && synced < head
+            && ((!wrote && attempted < head && (waited_for || stop)) || now - last_sync >= options.sync_interval)) {
+            try {
+                file.sync();
+                syncs.fetch_add(1, std::memory_order_relaxed);
+                synced = head;
+            } catch (FileHandler::FileException const &) {
+                sync_failures.fetch_add(1, std::memory_order_relaxed);
+            }
+            attempted = head;
+            last_sync = now;
+        }
+
+        lock.lock();
+        done = syncing ? attempted : head;
+        durable = syncing ? synced : head;
+        progress.notify_all();
+        if (wrote) {
+            continue;
+        }
+        if (stop) {
+            // A producer may still be copying into a claimed slot
+            if (head == tail.load(std::memory_order_acquire) && done == head) {
+                break;
+            }
+            continue;
+        }
+        if (flush_requested <= done) {
+            wake_writer.wait_for(lock, options.idle_wait);
+        }
+    }
+}
+
+void AsyncLogger::flush() {
+    std::uint64_t const target = tail.load(std::memory_order_acquire);
+    std::unique_lock<std::mutex> lock(mutex);
+    flush_requested = std::max(flush_requested, target);
+    wake_writer.notify_one();
+    progress.wait(lock, [&] {
+        return done >= target;
+    });
+    if (durable < target) {
+        throw FileHandler::FileSyncException(file.getPath());
+    }
+}
+
+AsyncLogger::Stats AsyncLogger::stats() const {
+    std::uint64_t const samples = enqueue_samples.load(std::memory_order_relaxed);
+    return {
+        tail.load(std::memory_order_relaxed),
+        dropped.load(std::memory_order_relaxed),
+        written.load(std::memory_order_relaxed),
+        failed.load(std::memory_order_relaxed),
+        batches.load(std::memory_order_relaxed),
+        syncs.load(std::memory_order_relaxed),
+        sync_failures.load(std::memory_order_relaxed),
+        samples,
+        samples > 0
+            ? static_cast<double>(enqueue_total_ns.load(std::memory_order_relaxed)) / static_cast<double>(samples)
+            : 0.0,
+        enqueue_max_ns.load(std::memory_order_relaxed)
+    };
+}
+
+AsyncLogger::~AsyncLogger() {
+    {
+        std::lock_guard<std::mutex> const lock(mutex);
+        stopping = true;
+    }
+    wake_writer.notify_one();
+    writer.join();
+}
@@ -0,0 +1,140 @@
+#ifndef ASYNCLOGGER_H
+#define ASYNCLOGGER_H
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "FileHandler.h"
+
+
+// Appends lines to a file from any number of threads without blocking them on the disk. A
+// producer claims a slot of a bounded lock-free ring with one compare-and-swap and copies the
+// line into it; a background thread writes the ready slots in order with writev straight from
+// the ring, a batch per call, and runs fdatasync for all lines written in a sync interval at once.
+class AsyncLogger {
+public:
+    // What log() does when the ring is full
+    enum class Overflow {
+        // Counts the line as dropped and returns at once
+        Drop,
+        // Waits for the writer to free a slot
+        Block
+    };
+
+    struct Options {
+        // Slots of the ring, rounded up to a power of two
+        std::size_t capacity = 1 << 16;
+        // Bytes gathered into one batch at most
+        std::size_t batch_size = 1 << 20;
+        // fdatasync at most this often while lines are written and once on close; 0 never syncs
+        std::chrono::milliseconds sync_interval{0};
+        // How long the writer sleeps when the ring is empty, which is how late a line may be
+        // written; flush() does not wait for it
+        std::chrono::microseconds idle_wait{500};
+        Overflow overflow = Overflow::Drop;
+    };
+
+    struct Stats {
+        std::uint64_t enqueued;
+        std::uint64_t dropped;
+        std::uint64_t written;
+        // Lines lost because the write failed; lines written before the failure count as written
+        std::uint64_t failed;
+        std::uint64_t batches;
+        std::uint64_t syncs;
+        // fdatasync calls that failed; their lines are synced again with the next one
+        std::uint64_t sync_failures;
+        // Time of one log() call, measured for every ENQUEUE_SAMPLE_EVERY-th call of a thread
+        std::uint64_t enqueue_samples;
+        double enqueue_mean_ns;
+        std::uint64_t enqueue_max_ns;
+    };
+
+    // Lines up to this long are copied into the slot, longer ones into a string of their own
+    static constexpr std::size_t INLINE_LINE_SIZE = 200;
+
+    static constexpr std::uint64_t ENQUEUE_SAMPLE_EVERY = 64;
+
+private:
+    struct alignas(64) Slot {
+        // Slot index i is free for the producer of ring position p when sequence == p and
+        // holds its line when sequence == p + 1
+        std::atomic<std::uint64_t> sequence;
+        std::uint32_t length;
+        char data[INLINE_LINE_SIZE + 1];
+        std::string overflow;
+    };
+
+    Options const options;
+    FileHandler file;
+    std::size_t const mask;
+    std::unique_ptr<Slot[]> slots;
+
+    alignas(64) std::atomic<std::uint64_t> tail{0};
+    alignas(64) std::atomic<std::uint64_t> dropped{0};
+    std::atomic<std::uint64_t> enqueue_samples{0};
+    std::atomic<std::uint64_t> enqueue_total_ns{0};
+    std::atomic<std::uint64_t> enqueue_max_ns{0};
+
+    // Owned by the writer thread
+    alignas(64) std::uint64_t head = 0;
+    std::vector<std::string_view> batch;
+    std::atomic<std::uint64_t> written{0};
+    std::atomic<std::uint64_t> failed{0};
+    std::atomic<std::uint64_t> batches{0};
+    std::atomic<std::uint64_t> syncs{0};
+    std::atomic<std::uint64_t> sync_failures{0};
+
+    std::mutex mutex;
+    std::condition_variable wake_writer;
+    std::condition_variable progress;
+    // Ring positions up to which lines are written, and with a sync interval an fdatasync was
+    // tried for them; flush() waits for it
+    std::uint64_t done = 0;
+    // Ring position up to which lines are on the disk, or just written without a sync interval
+    std::uint64_t durable = 0;
+    std::uint64_t flush_requested = 0;
+    bool stopping = false;
+    std::thread writer;
+
+    bool enqueue(std::string_view line);
+
+    // Writes the published lines from head on; false if there were none
+    bool writeBatch();
+
+    void run();
+
+public:
+    explicit AsyncLogger(std::filesystem::path const &path);
+
+    AsyncLogger(std::filesystem::path const &path, Options const &options);
+
+    AsyncLogger(AsyncLogger const &) = delete;
+
+    AsyncLogger &operator=(AsyncLogger const &) = delete;
+
+    // Queues the line; false if the ring was full and it was dropped
+    bool log(std::string_view line);
+
+    // Waits until the lines queued before are written, and synced with a sync interval; throws
+    // FileHandler::FileSyncException if the fdatasync for them failed
+    void flush();
+
+    Stats stats() const;
+
+    // Writes the queued lines and stops the writer; a failed last fdatasync cannot be reported
+    // here, call flush() before to see it
+    ~AsyncLogger();
+};
+
+
+#endif //ASYNCLOGGER_H
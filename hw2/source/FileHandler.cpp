@@ -1,52 +1,473 @@
 #include "FileHandler.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <thread>
 
-FileHandler::FileHandler(FsPath const &path, FileMode mode) {
-    std::ios::openmode result_mode = std::ios::binary;
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+
+FileHandler::FileHandler(FsPath const &path, FileMode mode) : FileHandler(path, mode, WriteOptions{}) {
+}
+
+FileHandler::FileHandler(FsPath const &path, FileMode mode, WriteOptions const &options)
+    : mode(mode), path(path), options(options) {
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
     switch (mode) {
         case FileMode::Read:
             if (!std::filesystem::exists(path)) {
                 throw FileNotFoundException(path);
             }
-
-            result_mode |= std::ios::in;
-            break;
+            openForReading();
+            return;
         case FileMode::Write:
-            result_mode |= std::ios::out | std::ios::trunc;
+            flags |= O_TRUNC;
             break;
         case FileMode::Append:
-            result_mode |= std::ios::app | std::ios::out;
+            flags |= O_APPEND;
             break;
     }
 
-    file.open(path, result_mode);
-    if (!file.is_open()) {
-        throw FileOpenException(path);;
+    fd = ::open(path.c_str(), flags, 0644);
+    if (fd < 0) {
+        throw FileOpenException(path);
     }
+    buffer.reserve(options.buffer_size);
 }
 
-std::optional<std::string> FileHandler::readLine() {
-    if (!file.is_open() || !file.good()) {
+void FileHandler::openForReading() {
+    fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw FileOpenException(path);
+    }
+    struct stat st{};
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        mapping_size = static_cast<std::size_t>(st.st_size);
+        if (mapping_size == 0) {
+            mapping = "";
+            return;
+        }
+        void *const mapped = mmap(nullptr, mapping_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped != MAP_FAILED) {
+            madvise(mapped, mapping_size, MADV_SEQUENTIAL);
+            mapping = static_cast<char const *>(mapped);
+            return;
+        }
+        mapping_size = 0;
+    }
+    read_buffer.resize(READ_CHUNK_SIZE);
+}
+
+bool FileHandler::fillReadBuffer() {
+    if (read_eof) {
+        return false;
+    }
+    if (position > 0) {
+        read_end -= position;
+        scanned -= position;
+        std::memmove(read_buffer.data(), read_buffer.data() + position, read_end);
+        position = 0;
+    }
+    if (read_buffer.size() - read_end < READ_CHUNK_SIZE / 2) {
+        read_buffer.resize(read_buffer.size() * 2);
+    }
+    while (true) {
+        ssize_t const n = ::read(fd, read_buffer.data() + read_end, read_buffer.size() - read_end);
+        if (n > 0) {
+            read_end += static_cast<std::size_t>(n);
+            return true;
+        }
+        if (n == 0) {
+            read_eof = true;
+            return false;
+        }
+        if (errno != EINTR) {
+            throw FileReadException(path);
+        }
+    }
+}
+
+std::string_view FileHandler::takeLine(char const *data, std::size_t newline) {
+    std::string_view line(data + position, newline - position);
+    if (!line.empty() && line.back() == '\r') {
+        line.remove_suffix(1);
+    }
+    position = newline + 1;
+    return line;
+}
+
+std::optional<std::string_view> FileHandler::readLineView() {
+    if (mode != FileMode::Read) {
+        throw FileReadException(path);
+    }
+    while (true) {
+        char const *const data = mapping != nullptr ? mapping : read_buffer.data();
+        if (next_newline < newlines.size()) {
+            return takeLine(data, newlines[next_newline++]);
+        }
+        // All the line ends found are read, the buffer has none left before scanned
+        newlines.clear();
+        next_newline = 0;
+        std::size_t const end = mapping != nullptr ? mapping_size : read_end;
+        if (scanned < end) {
+            std::size_t const block = std::min(end - scanned, SCAN_BLOCK_SIZE);
+            NewlineScanner::find(std::string_view(data + scanned, block), scanned, newlines);
+            scanned += block;
+            continue;
+        }
+        if (mapping != nullptr || !fillReadBuffer()) {
+            break;
+        }
+    }
+
+    char const *const data = mapping != nullptr ? mapping : read_buffer.data();
+    std::size_t const end = mapping != nullptr ? mapping_size : read_end;
+    if (position == end) {
+        return std::nullopt;
+    }
+    // The last line has no '\n'
+    std::string_view const line(data + position, end - position);
+    position = end;
+    return line;
+}
+
+std::size_t FileHandler::countLines() {
+    if (mode != FileMode::Read) {
+        throw FileReadException(path);
+    }
+    if (mapping != nullptr) {
+        std::string_view const rest(mapping + position, mapping_size - position);
+        position = scanned = mapping_size;
+        newlines.clear();
+        next_newline = 0;
+        return NewlineScanner::count(rest) + (!rest.empty() && rest.back() != '\n');
+    }
+
+    std::size_t count = 0;
+    bool unterminated = false;
+    do {
+        std::string_view const rest(read_buffer.data() + position, read_end - position);
+        if (!rest.empty()) {
+            count += NewlineScanner::count(rest);
+            unterminated = rest.back() != '\n';
+        }
+        position = read_end;
+        scanned = read_end;
+    } while (fillReadBuffer());
+    newlines.clear();
+    next_newline = 0;
+    return count + unterminated;
+}
+
+std::size_t FileHandler::threadCount(ParallelOptions const &parallel) {
+    if (parallel.threads > 0) {
+        return parallel.threads;
+    }
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+std::vector<FileHandler::Chunk> FileHandler::splitChunks(ParallelOptions const &parallel) {
+    if (mode != FileMode::Read) {
+        throw FileReadException(path);
+    }
+    if (mapping == nullptr) {
+        while (fillReadBuffer()) {
+        }
+    }
+    char const *const data = mapping != nullptr ? mapping : read_buffer.data();
+    std::size_t const end = mapping != nullptr ? mapping_size : read_end;
+    std::string_view const rest(data + position, end - position);
+    position = end;
+    scanned = end;
+    newlines.clear();
+    next_newline = 0;
+
+    std::size_t count = parallel.chunks;
+    if (count == 0) {
+        count = std::min(threadCount(parallel) * CHUNKS_PER_THREAD, rest.size() / MIN_CHUNK_SIZE);
+    }
+    count = std::max<std::size_t>(1, count);
+    std::vector<Chunk> chunks;
+    chunks.reserve(count);
+    std::size_t begin = 0;
+    for (std::size_t i = 1; i <= count && begin < rest.size(); ++i) {
+        // Every chunk but the last ends after the first '\n' at or past its share
+        std::size_t chunk_end = rest.size();
+        if (i < count) {
+            std::size_t const share = std::max(begin, rest.size() / count * i);
+            std::size_t const newline = rest.find('\n', share);
+            chunk_end = newline != std::string_view::npos ? newline + 1 : rest.size();
+        }
+        chunks.push_back({chunks.size(), begin, rest.substr(begin, chunk_end - begin)});
+        begin = chunk_end;
+    }
+    return chunks;
+}
+
+void FileHandler::runParallel(std::size_t tasks, std::size_t threads,
+                              std::function<void(std::size_t)> const &task) {
+    std::atomic<std::size_t> next{0};
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    auto work = [&] {
+        for (std::size_t i = next++; i < tasks; i = next++) {
+            try {
+                task(i);
+            } catch (...) {
+                std::lock_guard<std::mutex> const lock(error_mutex);
+                if (!error) {
+                    error = std::current_exception();
+                }
+                next = tasks;
+            }
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (std::size_t i = 1; i < std::min(threads, tasks); ++i) {
+        pool.emplace_back(work);
+    }
+    work();
+    for (std::thread &thread: pool) {
+        thread.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+void FileHandler::enableLineIndex(std::size_t checkpoint_interval) {
+    persist_index = true;
+    index_interval = checkpoint_interval;
+    line_index.reset();
+    if (mode != FileMode::Read) {
+        writeBuffer();
+        lineIndex();
+    }
+}
+
+FileHandler::FsPath FileHandler::indexPath(FsPath const &path) {
+    FsPath index_path = path;
+    index_path += ".idx";
+    return index_path;
+}
+
+std::pair<std::uint64_t, std::int64_t> FileHandler::fileState() const {
+    struct stat st{};
+    if (fstat(fd, &st) < 0) {
         throw FileReadException(path);
     }
-    std::string line;
-    if (!std::getline(file, line)) {
-        if (file.eof()) {
-            return std::nullopt;
+    return {static_cast<std::uint64_t>(st.st_size),
+            static_cast<std::int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec};
+}
+
+LineIndex &FileHandler::lineIndex() {
+    if (line_index.has_value()) {
+        return *line_index;
+    }
+    auto const [file_size, mtime_ns] = fileState();
+    LineIndex index(index_interval);
+    if (persist_index && index.load(indexPath(path), file_size, mtime_ns)) {
+        line_index = std::move(index);
+        return *line_index;
+    }
+
+    if (mode == FileMode::Read) {
+        if (mapping == nullptr) {
+            throw FileReadException(path);
+        }
+        index.append(std::string_view(mapping, mapping_size));
+        if (persist_index) {
+            index.save(indexPath(path), mtime_ns);
+        }
+    } else {
+        FileHandler reader(path, FileMode::Read);
+        if (reader.mapping == nullptr) {
+            throw FileReadException(path);
         }
+        index.append(std::string_view(reader.mapping, reader.mapping_size));
+    }
+    line_index = std::move(index);
+    return *line_index;
+}
+
+std::optional<std::string_view> FileHandler::readLineView(std::size_t n) {
+    if (mode != FileMode::Read) {
         throw FileReadException(path);
     }
+    LineIndex const &index = lineIndex();
+    if (n >= index.lineCount()) {
+        return std::nullopt;
+    }
+    std::size_t const begin = std::min<std::uint64_t>(index.offset(n), mapping_size);
+    auto const *const newline = static_cast<char const *>(
+        std::memchr(mapping + begin, '\n', mapping_size - begin));
+    std::string_view line(mapping + begin, (newline != nullptr ? newline - mapping : mapping_size) - begin);
+    if (newline != nullptr && !line.empty() && line.back() == '\r') {
+        line.remove_suffix(1);
+    }
     return line;
 }
 
+std::optional<std::string> FileHandler::readLine(std::size_t n) {
+    std::optional<std::string_view> const line = readLineView(n);
+    if (!line.has_value()) {
+        return std::nullopt;
+    }
+    return std::string(*line);
+}
+
+std::size_t FileHandler::lineCount() {
+    if (mode != FileMode::Read) {
+        throw FileReadException(path);
+    }
+    return lineIndex().lineCount();
+}
+
+std::optional<std::string> FileHandler::readLine() {
+    std::optional<std::string_view> const line = readLineView();
+    if (!line.has_value()) {
+        return std::nullopt;
+    }
+    return std::string(*line);
+}
+
+FileHandler::LineRange FileHandler::lines() {
+    return LineRange(*this);
+}
+
+void FileHandler::bufferLine(std::string_view line) {
+    if (mode == FileMode::Read) {
+        throw FileWriteException(path);
+    }
+    buffer.append(line);
+    buffer.push_back('\n');
+    if (options.buffer_size > 0 && buffer.size() >= options.buffer_size) {
+        writeBuffer();
+    }
+}
+
+void FileHandler::writeBuffer() {
+    std::size_t written = 0;
+    while (written < buffer.size()) {
+        ssize_t const n = ::write(fd, buffer.data() + written, buffer.size() - written);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (line_index.has_value()) {
+                line_index->append(std::string_view(buffer).substr(0, written));
+            }
+            buffer.erase(0, written);
+            throw FileWriteException(path);
+        }
+        written += static_cast<std::size_t>(n);
+    }
+    if (line_index.has_value()) {
+        line_index->append(buffer);
+    }
+    buffer.clear();
+}
+
+void FileHandler::endBatch() {
+    if (options.buffer_size == 0) {
+        writeBuffer();
+    }
+    if (options.durability == Durability::PerLine || options.durability == Durability::PerBatch) {
+        sync();
+    }
+}
+
 void FileHandler::writeLine(std::string_view line) {
-    if (!file.is_open() || !file.good()) {
+    bufferLine(line);
+    if (options.buffer_size == 0) {
+        writeBuffer();
+    }
+    if (options.durability == Durability::PerLine) {
+        sync();
+    }
+}
+
+std::size_t FileHandler::writeLinesDirect(std::vector<std::string_view> const &lines) {
+    if (mode == FileMode::Read) {
+        throw FileWriteException(path);
+    }
+    writeBuffer();
+
+    // Every line takes an iovec for itself and one for its '\n'
+    static char const newline = '\n';
+    std::size_t const lines_per_call = IOV_MAX / 2;
+    std::vector<iovec> pieces;
+    pieces.reserve(2 * std::min(lines.size(), lines_per_call));
+    for (std::size_t first_line = 0; first_line < lines.size(); first_line += lines_per_call) {
+        std::size_t const end_line = std::min(lines.size(), first_line + lines_per_call);
+        pieces.clear();
+        for (std::size_t i = first_line; i < end_line; ++i) {
+            pieces.push_back({const_cast<char *>(lines[i].data()), lines[i].size()});
+            pieces.push_back({const_cast<char *>(&newline), 1});
+        }
+
+        std::size_t piece = 0;
+        while (piece < pieces.size()) {
+            ssize_t const n = ::writev(fd, pieces.data() + piece, static_cast<int>(pieces.size() - piece));
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return first_line + piece / 2;
+            }
+            // Skips the written pieces and moves into a piece written in part
+            auto left = static_cast<std::size_t>(n);
+            while (piece < pieces.size() && pieces[piece].iov_len <= left) {
+                left -= pieces[piece].iov_len;
+                if (line_index.has_value()) {
+                    line_index->append(std::string_view(static_cast<char const *>(pieces[piece].iov_base),
+                                                        pieces[piece].iov_len));
+                }
+                ++piece;
+            }
+            if (left > 0) {
+                if (line_index.has_value()) {
+                    line_index->append(std::string_view(static_cast<char const *>(pieces[piece].iov_base), left));
+                }
+                pieces[piece].iov_base = static_cast<char *>(pieces[piece].iov_base) + left;
+                pieces[piece].iov_len -= left;
+            }
+        }
+    }
+    if (options.durability == Durability::PerLine || options.durability == Durability::PerBatch) {
+        sync();
+    }
+    return lines.size();
+}
+
+void FileHandler::flush() {
+    if (mode == FileMode::Read) {
         throw FileWriteException(path);
     }
-    if (!(file << line << "\n")) {
+    writeBuffer();
+    if (options.durability == Durability::PerBatch) {
+        sync();
+    }
+}
+
+void FileHandler::sync() {
+    if (mode == FileMode::Read) {
         throw FileWriteException(path);
     }
-    file.flush();
+    writeBuffer();
+    if (fdatasync(fd) < 0) {
+        throw FileSyncException(path);
+    }
 }
 
 std::uint64_t FileHandler::size() const {
@@ -58,5 +479,25 @@ FileHandler::FsPath const &FileHandler::getPath() const {
 }
 
 FileHandler::~FileHandler() {
-    file.close();
+    if (mapping != nullptr && mapping_size > 0) {
+        munmap(const_cast<char *>(mapping), mapping_size);
+    }
+    if (mode != FileMode::Read) {
+        // A destructor cannot report the failure, call flush() or sync() to see it
+        try {
+            writeBuffer();
+            if (options.durability == Durability::OnClose) {
+                fdatasync(fd);
+            }
+            // Saved only if nobody else has written to the file meanwhile
+            if (persist_index && line_index.has_value()) {
+                auto const [file_size, mtime_ns] = fileState();
+                if (file_size == line_index->size()) {
+                    line_index->save(indexPath(path), mtime_ns);
+                }
+            }
+        } catch (FileException const &) {
+        }
+    }
+    close(fd);
 }
@@ -1,15 +1,162 @@
 #ifndef FILEHANDLER_H
 #define FILEHANDLER_H
+#include <cstddef>
+#include <cstdint>
 #include <filesystem>
+#include <functional>
+#include <iterator>
 #include <optional>
 #include <fstream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "LineIndex.h"
+#include "NewlineScanner.h"
 
 
 class FileHandler {
     using FsPath = std::filesystem::path;
 
-    std::fstream file;
+public:
+    enum class FileMode {
+        Write,
+        Read,
+        Append
+    };
+
+    // When written lines are forced to the disk with fdatasync, besides explicit sync() calls
+    enum class Durability {
+        Never,
+        // After every writeLine() and every writeLines() or writeLinesDirect() batch
+        PerLine,
+        // After every writeLines() or writeLinesDirect() batch and flush()
+        PerBatch,
+        OnClose
+    };
+
+    struct WriteOptions {
+        // Lines are collected up to this many bytes before they are written out;
+        // 0 writes every line with its own write call
+        std::size_t buffer_size = 0;
+        Durability durability = Durability::Never;
+    };
+
+    // Buffered writing without implicit fdatasync
+    static constexpr std::size_t DEFAULT_BUFFER_SIZE = 1 << 16;
+
+    // Chunk size of reads from files that cannot be mapped
+    static constexpr std::size_t READ_CHUNK_SIZE = 1 << 16;
+
+    // Bytes scanned for line ends at once, small enough for the offsets to stay in the cache
+    static constexpr std::size_t SCAN_BLOCK_SIZE = 1 << 16;
+
+    struct ParallelOptions {
+        // 0 uses a thread per core
+        std::size_t threads = 0;
+        // Byte ranges the lines are split into; more than threads even out uneven chunks,
+        // 0 makes CHUNKS_PER_THREAD per thread but none below MIN_CHUNK_SIZE
+        std::size_t chunks = 0;
+    };
+
+    static constexpr std::size_t CHUNKS_PER_THREAD = 4;
+
+    // Smaller chunks cost more in threads than they save
+    static constexpr std::size_t MIN_CHUNK_SIZE = 1 << 20;
+
+    // The lines of one byte range that starts after a '\n' and ends with one or the file
+    struct Chunk {
+        // Position of the chunk among all chunks, in file order
+        std::size_t index;
+        // Of data from the first byte that remained to be read
+        std::size_t offset;
+        std::string_view data;
+
+        // Calls on_line(std::string_view) for every line, without its "\n" or "\r\n"
+        template<typename Function>
+        void forEachLine(Function &&on_line) const {
+            std::vector<std::size_t> newlines;
+            std::size_t start = 0;
+            for (std::size_t block = 0; block < data.size(); block += SCAN_BLOCK_SIZE) {
+                newlines.clear();
+                NewlineScanner::find(data.substr(block, SCAN_BLOCK_SIZE), block, newlines);
+                for (std::size_t const newline: newlines) {
+                    std::size_t const length = newline - start - (newline > start && data[newline - 1] == '\r');
+                    on_line(data.substr(start, length));
+                    start = newline + 1;
+                }
+            }
+            if (start < data.size()) {
+                on_line(data.substr(start));
+            }
+        }
+
+        std::size_t countLines() const {
+            return NewlineScanner::count(data) + (!data.empty() && data.back() != '\n');
+        }
+    };
+
+private:
+    int fd = -1;
+    FileMode mode;
     FsPath path;
+    WriteOptions options;
+    std::string buffer;
+
+    // Read mode: a regular file is mapped and lines point into the mapping. Pipes and other
+    // files that cannot be mapped are read in chunks into read_buffer, reused for every line.
+    char const *mapping = nullptr;
+    std::size_t mapping_size = 0;
+    std::string read_buffer;
+    std::size_t read_end = 0;
+    bool read_eof = false;
+    // The next unread byte of the mapping or of read_buffer
+    std::size_t position = 0;
+    // Offsets of the '\n' found by the last scan, those from next_newline on are not read yet;
+    // everything before scanned has been scanned
+    std::vector<std::size_t> newlines;
+    std::size_t next_newline = 0;
+    std::size_t scanned = 0;
+
+    // Line offsets for readLine(n) and lineCount(), built on first use. With persist_index it is
+    // kept in indexPath(path) and, in the write modes, extended with every line written.
+    std::optional<LineIndex> line_index;
+    bool persist_index = false;
+    std::size_t index_interval = LineIndex::DEFAULT_CHECKPOINT_INTERVAL;
+
+    void openForReading();
+
+    // The index of the file as it is now: loaded from indexPath(path) if it is saved for the
+    // current size and modification time, otherwise built with one scan of the file
+    LineIndex &lineIndex();
+
+    // Size and modification time in nanoseconds, which tell whether a saved index still fits
+    std::pair<std::uint64_t, std::int64_t> fileState() const;
+
+    // Reads more into read_buffer, keeping the unread part; false at the end of the file
+    bool fillReadBuffer();
+
+    // The line from position up to the '\n' at the given offset, without a '\r' before it
+    std::string_view takeLine(char const *data, std::size_t newline);
+
+    static std::size_t threadCount(ParallelOptions const &parallel);
+
+    // Splits the remaining lines into chunks and marks them read; a file that cannot be mapped
+    // is read to the end into read_buffer first
+    std::vector<Chunk> splitChunks(ParallelOptions const &parallel);
+
+    // Runs task(0) .. task(tasks - 1) on the calling thread and threads - 1 more, rethrowing the
+    // first exception of a task once all threads are done
+    static void runParallel(std::size_t tasks, std::size_t threads, std::function<void(std::size_t)> const &task);
+
+    void bufferLine(std::string_view line);
+
+    void writeBuffer();
+
+    void endBatch();
 
 public:
     class FileException : public std::runtime_error {
@@ -65,23 +212,174 @@ public:
         }
     };
 
-
-    enum class FileMode {
-        Write,
-        Read,
-        Append
+    class FileSyncException : public FileException {
+    public:
+        explicit FileSyncException(std::optional<FsPath> const &file_path)
+            : FileException("Cannot sync file", file_path) {
+        }
     };
 
+    // Every written line is passed to the system right away, as with the default WriteOptions
     explicit FileHandler(FsPath const &path, FileMode mode);
 
+    FileHandler(FsPath const &path, FileMode mode, WriteOptions const &options);
+
     FileHandler(FileHandler const &) = delete;
 
     FileHandler &operator=(FileHandler const &) = delete;
 
+    class LineIterator {
+        FileHandler *handler = nullptr;
+        std::string_view line;
+
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = std::string_view;
+        using difference_type = std::ptrdiff_t;
+        using pointer = std::string_view const *;
+        using reference = std::string_view const &;
+
+        LineIterator() = default;
+
+        explicit LineIterator(FileHandler &handler) : handler(&handler) {
+            ++*this;
+        }
+
+        reference operator*() const {
+            return line;
+        }
+
+        pointer operator->() const {
+            return &line;
+        }
+
+        LineIterator &operator++() {
+            std::optional<std::string_view> const next = handler->readLineView();
+            if (next.has_value()) {
+                line = *next;
+            } else {
+                handler = nullptr;
+            }
+            return *this;
+        }
+
+        bool operator==(LineIterator const &other) const {
+            return handler == other.handler;
+        }
+
+        bool operator!=(LineIterator const &other) const {
+            return handler != other.handler;
+        }
+    };
+
+    // The remaining lines, for (std::string_view line : handler.lines())
+    class LineRange {
+        FileHandler &handler;
+
+    public:
+        explicit LineRange(FileHandler &handler) : handler(handler) {
+        }
+
+        LineIterator begin() const {
+            return LineIterator(handler);
+        }
+
+        LineIterator end() const {
+            return {};
+        }
+    };
+
     std::optional<std::string> readLine();
 
+    // The next line without its '\n' or "\r\n", without copying. It stays valid as long as the
+    // handler for a mapped file, and until the next read for a file that cannot be mapped.
+    std::optional<std::string_view> readLineView();
+
+    // Lines that remain to be read, counted with NewlineScanner without splitting them. They
+    // count as read, for a mapped file as much as for a pipe, so readLine() returns nothing after it.
+    std::size_t countLines();
+
+    LineRange lines();
+
+    // Keeps the line index in indexPath(path) to reuse it while the file does not change.
+    // In the write modes call it before writing: the index of what is in the file is loaded or
+    // built, extended with the lines written and saved when the handler is closed.
+    void enableLineIndex(std::size_t checkpoint_interval = LineIndex::DEFAULT_CHECKPOINT_INTERVAL);
+
+    static FsPath indexPath(FsPath const &path);
+
+    // Line n counted from 0, found through the line index without reading the lines before it.
+    // It does not move the position of readLine().
+    std::optional<std::string> readLine(std::size_t n);
+
+    // Line n as a view into the mapped file; a file that cannot be mapped has no line index
+    std::optional<std::string_view> readLineView(std::size_t n);
+
+    // Lines in the whole file, from the line index
+    std::size_t lineCount();
+
+    // Calls process(Chunk const &) for every chunk of the remaining lines on a pool of threads,
+    // concurrently and in any order. No line remains to be read after it.
+    template<typename Function>
+    void processChunks(Function &&process, ParallelOptions const &parallel = {}) {
+        std::vector<Chunk> const chunks = splitChunks(parallel);
+        runParallel(chunks.size(), threadCount(parallel), [&](std::size_t i) {
+            process(chunks[i]);
+        });
+    }
+
+    // As processChunks(), but returns the results of process in the order of the chunks in the
+    // file, so merging them one after another keeps the order of the lines
+    template<typename Function>
+    auto mapChunks(Function &&process, ParallelOptions const &parallel = {}) {
+        using Result = std::invoke_result_t<Function &, Chunk const &>;
+        std::vector<Chunk> const chunks = splitChunks(parallel);
+        std::vector<std::optional<Result>> results(chunks.size());
+        runParallel(chunks.size(), threadCount(parallel), [&](std::size_t i) {
+            results[i].emplace(process(chunks[i]));
+        });
+        std::vector<Result> ordered;
+        ordered.reserve(results.size());
+        for (std::optional<Result> &result: results) {
+            ordered.push_back(std::move(*result));
+        }
+        return ordered;
+    }
+
+    // Calls on_line(std::string_view) for every remaining line from several threads at once
+    template<typename Function>
+    void forEachLineParallel(Function &&on_line, ParallelOptions const &parallel = {}) {
+        processChunks([&](Chunk const &chunk) {
+            chunk.forEachLine(on_line);
+        }, parallel);
+    }
+
     void writeLine(std::string_view line);
 
+    // Writes a range of lines as one batch: with one write call when they fit into the buffer
+    template<typename Range>
+    void writeLines(Range const &lines) {
+        for (auto const &line: lines) {
+            bufferLine(line);
+        }
+        endBatch();
+    }
+
+    // Writes the lines with writev straight from the memory they are in, after the buffered ones,
+    // instead of copying them into the buffer. Returns how many lines were written whole, which
+    // is fewer than lines.size() only if writev failed: that failure is not thrown, so the caller
+    // knows which lines were lost. Like writeLines() it throws FileWriteException in read mode or
+    // if the buffered lines cannot be written, in which case none of the lines are, and
+    // FileSyncException if the fdatasync of Durability::PerLine or PerBatch fails after all of
+    // them were written.
+    std::size_t writeLinesDirect(std::vector<std::string_view> const &lines);
+
+    // Passes the buffered lines to the system
+    void flush();
+
+    // Flushes and waits until the written data is on the disk
+    void sync();
+
     std::uint64_t size() const;
 
     FsPath const &getPath() const;
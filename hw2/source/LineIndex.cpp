@@ -0,0 +1,138 @@
+#include "LineIndex.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <system_error>
+
+#include "NewlineScanner.h"
+
+
+namespace {
+    // Newlines are looked up in blocks of this size, so the offsets found stay small
+    constexpr std::size_t APPEND_BLOCK_SIZE = 1 << 16;
+}
+
+LineIndex::LineIndex(std::size_t checkpoint_interval) : checkpoint_interval(std::max<std::size_t>(1, checkpoint_interval)) {
+    addStart(0);
+}
+
+void LineIndex::addStart(std::uint64_t start) {
+    if (starts % checkpoint_interval == 0) {
+        checkpoints.push_back({start, deltas.size()});
+    } else {
+        for (std::uint64_t delta = start - last_start; ; delta >>= 7) {
+            if (delta < 0x80) {
+                deltas.push_back(static_cast<char>(delta));
+                break;
+            }
+            deltas.push_back(static_cast<char>((delta & 0x7f) | 0x80));
+        }
+    }
+    last_start = start;
+    ++starts;
+}
+
+void LineIndex::append(std::string_view data) {
+    for (std::size_t block = 0; block < data.size(); block += APPEND_BLOCK_SIZE) {
+        newlines.clear();
+        NewlineScanner::find(data.substr(block, APPEND_BLOCK_SIZE), indexed + block, newlines);
+        for (std::size_t const newline: newlines) {
+            addStart(newline + 1);
+        }
+    }
+    indexed += data.size();
+}
+
+std::size_t LineIndex::lineCount() const {
+    // The start after a final '\n' is the end of the file, not a line
+    return starts - (last_start == indexed);
+}
+
+std::uint64_t LineIndex::offset(std::size_t line) const {
+    Checkpoint const &checkpoint = checkpoints[line / checkpoint_interval];
+    std::uint64_t offset = checkpoint.offset;
+    std::size_t position = checkpoint.delta_position;
+    for (std::size_t i = line % checkpoint_interval; i > 0; --i) {
+        std::uint64_t delta = 0;
+        for (unsigned shift = 0; position < deltas.size(); shift += 7) {
+            auto const byte = static_cast<unsigned char>(deltas[position++]);
+            delta |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+            if (byte < 0x80) {
+                break;
+            }
+        }
+        offset += delta;
+    }
+    return offset;
+}
+
+std::uint64_t LineIndex::size() const {
+    return indexed;
+}
+
+bool LineIndex::load(std::filesystem::path const &index_path, std::uint64_t file_size, std::int64_t mtime_ns) {
+    std::ifstream in(index_path, std::ios::binary);
+    Header header{};
+    if (!in.read(reinterpret_cast<char *>(&header), sizeof(header))
+        || std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != VERSION
+        || header.file_size != file_size || header.mtime_ns != mtime_ns || header.checkpoint_interval == 0
+        || header.starts == 0 || header.last_start > file_size || header.starts > file_size + 1
+        || header.checkpoints != (header.starts + header.checkpoint_interval - 1) / header.checkpoint_interval
+        || header.deltas_size > 10 * header.starts) {
+        return false;
+    }
+    std::vector<Checkpoint> loaded_checkpoints(header.checkpoints);
+    std::string loaded_deltas(header.deltas_size, '\0');
+    if (!in.read(reinterpret_cast<char *>(loaded_checkpoints.data()),
+                 static_cast<std::streamsize>(header.checkpoints * sizeof(Checkpoint)))
+        || !in.read(loaded_deltas.data(), static_cast<std::streamsize>(header.deltas_size))
+        || in.peek() != std::ifstream::traits_type::eof()) {
+        return false;
+    }
+    for (Checkpoint const &checkpoint: loaded_checkpoints) {
+        if (checkpoint.offset > file_size || checkpoint.delta_position > header.deltas_size) {
+            return false;
+        }
+    }
+
+    checkpoint_interval = header.checkpoint_interval;
+    checkpoints = std::move(loaded_checkpoints);
+    deltas = std::move(loaded_deltas);
+    starts = header.starts;
+    last_start = header.last_start;
+    indexed = header.file_size;
+    return true;
+}
+
+bool LineIndex::save(std::filesystem::path const &index_path, std::int64_t mtime_ns) const {
+    Header header{};
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.checkpoint_interval = static_cast<std::uint32_t>(checkpoint_interval);
+    header.file_size = indexed;
+    header.mtime_ns = mtime_ns;
+    header.starts = starts;
+    header.last_start = last_start;
+    header.checkpoints = checkpoints.size();
+    header.deltas_size = deltas.size();
+
+    // Readers see either the old index or the whole new one
+    std::filesystem::path temporary = index_path;
+    temporary += ".tmp";
+    {
+        std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<char const *>(&header), sizeof(header));
+        out.write(reinterpret_cast<char const *>(checkpoints.data()),
+                  static_cast<std::streamsize>(checkpoints.size() * sizeof(Checkpoint)));
+        out.write(deltas.data(), static_cast<std::streamsize>(deltas.size()));
+        if (!out.flush()) {
+            std::error_code ignored;
+            std::filesystem::remove(temporary, ignored);
+            return false;
+        }
+    }
+    std::error_code error;
+    std::filesystem::rename(temporary, index_path, error);
+    return !error;
+}
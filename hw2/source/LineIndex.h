@@ -0,0 +1,76 @@
+#ifndef LINEINDEX_H
+#define LINEINDEX_H
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <vector>
+
+
+// Offsets of the lines of a file. Every checkpoint_interval-th offset is kept as is, the others
+// as varint-encoded distances to the previous one, so an index takes one or two bytes per line
+// and finding a line decodes fewer than checkpoint_interval distances. It is saved next to the
+// file with the size and modification time the file had, and only loaded back for that state.
+class LineIndex {
+public:
+    static constexpr std::size_t DEFAULT_CHECKPOINT_INTERVAL = 64;
+
+    static constexpr char MAGIC[8] = {'H', 'W', '2', 'L', 'I', 'N', 'D', 'X'};
+    static constexpr std::uint32_t VERSION = 1;
+
+private:
+    struct Header {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t checkpoint_interval;
+        std::uint64_t file_size;
+        std::int64_t mtime_ns;
+        std::uint64_t starts;
+        std::uint64_t last_start;
+        std::uint64_t checkpoints;
+        std::uint64_t deltas_size;
+    };
+
+    struct Checkpoint {
+        std::uint64_t offset;
+        // Where the distances of the lines after it begin in deltas
+        std::uint64_t delta_position;
+    };
+
+    std::size_t checkpoint_interval;
+    std::vector<Checkpoint> checkpoints;
+    std::string deltas;
+    // Line starts recorded, the last may be the end of the file
+    std::uint64_t starts = 0;
+    std::uint64_t last_start = 0;
+    std::uint64_t indexed = 0;
+    std::vector<std::size_t> newlines;
+
+    void addStart(std::uint64_t start);
+
+public:
+    explicit LineIndex(std::size_t checkpoint_interval = DEFAULT_CHECKPOINT_INTERVAL);
+
+    // Indexes the next bytes of the file
+    void append(std::string_view data);
+
+    std::size_t lineCount() const;
+
+    // Offset of the first byte of a line below lineCount()
+    std::uint64_t offset(std::size_t line) const;
+
+    // Bytes of the file indexed so far
+    std::uint64_t size() const;
+
+    // Replaces the index with the one saved for a file of this size and modification time;
+    // false if there is none, it is damaged or it was saved for another state of the file
+    bool load(std::filesystem::path const &index_path, std::uint64_t file_size, std::int64_t mtime_ns);
+
+    // Saves the index of size() bytes for the file modified at mtime_ns, replacing the old one
+    // at once; false if it cannot be written
+    bool save(std::filesystem::path const &index_path, std::int64_t mtime_ns) const;
+};
+
+
+#endif //LINEINDEX_H
@@ -0,0 +1,197 @@
+#include "NewlineScanner.h"
+
+#include <cstdint>
+#include <cstring>
+
+// SSE2 is part of x86-64, 32-bit x86 gets memchr
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define NEWLINESCANNER_X86 1
+#endif
+
+
+namespace {
+    void findScalar(char const *data, std::size_t size, std::size_t base, std::vector<std::size_t> &out) {
+        for (std::size_t i = 0; i < size; ++i) {
+            if (data[i] == '\n') {
+                out.push_back(base + i);
+            }
+        }
+    }
+
+    std::size_t countScalar(char const *data, std::size_t size) {
+        std::size_t count = 0;
+        for (std::size_t i = 0; i < size; ++i) {
+            count += data[i] == '\n';
+        }
+        return count;
+    }
+
+    void findMemchr(char const *data, std::size_t size, std::size_t base, std::vector<std::size_t> &out) {
+        char const *const end = data + size;
+        for (char const *p = data; p < end;) {
+            auto const *const newline = static_cast<char const *>(std::memchr(p, '\n', end - p));
+            if (newline == nullptr) {
+                break;
+            }
+            out.push_back(base + (newline - data));
+            p = newline + 1;
+        }
+    }
+
+    std::size_t countMemchr(char const *data, std::size_t size) {
+        std::size_t count = 0;
+        char const *const end = data + size;
+        for (char const *p = data; p < end; ++count) {
+            auto const *const newline = static_cast<char const *>(std::memchr(p, '\n', end - p));
+            if (newline == nullptr) {
+                break;
+            }
+            p = newline + 1;
+        }
+        return count;
+    }
+
+    // Appends the positions of the set bits of a block mask
+    inline void pushMask(std::uint64_t mask, std::size_t offset, std::vector<std::size_t> &out) {
+        while (mask != 0) {
+            out.push_back(offset + static_cast<std::size_t>(__builtin_ctzll(mask)));
+            mask &= mask - 1;
+        }
+    }
+
+#ifdef NEWLINESCANNER_X86
+    void findSSE2(char const *data, std::size_t size, std::size_t base, std::vector<std::size_t> &out) {
+        __m128i const newline = _mm_set1_epi8('\n');
+        std::size_t i = 0;
+        for (; i + 16 <= size; i += 16) {
+            __m128i const chunk = _mm_loadu_si128(reinterpret_cast<__m128i const *>(data + i));
+            pushMask(static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline))), base + i, out);
+        }
+        findScalar(data + i, size - i, base + i, out);
+    }
+
+    // Per-byte counters are bumped by subtracting the 0xFF compare results and folded into
+    // 64-bit sums before they can overflow
+    std::size_t countSSE2(char const *data, std::size_t size) {
+        __m128i const newline = _mm_set1_epi8('\n');
+        __m128i total = _mm_setzero_si128();
+        std::size_t i = 0;
+        while (i + 16 <= size) {
+            __m128i counters = _mm_setzero_si128();
+            for (int round = 0; round < 255 && i + 16 <= size; ++round, i += 16) {
+                __m128i const chunk = _mm_loadu_si128(reinterpret_cast<__m128i const *>(data + i));
+                counters = _mm_sub_epi8(counters, _mm_cmpeq_epi8(chunk, newline));
+            }
+            total = _mm_add_epi64(total, _mm_sad_epu8(counters, _mm_setzero_si128()));
+        }
+        std::size_t const vector_count = static_cast<std::size_t>(_mm_cvtsi128_si64(total))
+                                         + static_cast<std::size_t>(_mm_cvtsi128_si64(_mm_unpackhi_epi64(total, total)));
+        return vector_count + countScalar(data + i, size - i);
+    }
+
+    __attribute__((target("avx2")))
+    void findAVX2(char const *data, std::size_t size, std::size_t base, std::vector<std::size_t> &out) {
+        __m256i const newline = _mm256_set1_epi8('\n');
+        std::size_t i = 0;
+        for (; i + 64 <= size; i += 64) {
+            __m256i const low = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(data + i));
+            __m256i const high = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(data + i + 32));
+            std::uint64_t const mask =
+                    static_cast<std::uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(low, newline)))
+                    | static_cast<std::uint64_t>(static_cast<std::uint32_t>(
+                          _mm256_movemask_epi8(_mm256_cmpeq_epi8(high, newline)))) << 32;
+            pushMask(mask, base + i, out);
+        }
+        findSSE2(data + i, size - i, base + i, out);
+    }
+
+    __attribute__((target("avx2")))
+    std::size_t countAVX2(char const *data, std::size_t size) {
+        __m256i const newline = _mm256_set1_epi8('\n');
+        __m256i total = _mm256_setzero_si256();
+        std::size_t i = 0;
+        while (i + 64 <= size) {
+            __m256i low_counters = _mm256_setzero_si256();
+            __m256i high_counters = _mm256_setzero_si256();
+            for (int round = 0; round < 255 && i + 64 <= size; ++round, i += 64) {
+                __m256i const low = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(data + i));
+                __m256i const high = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(data + i + 32));
+                low_counters = _mm256_sub_epi8(low_counters, _mm256_cmpeq_epi8(low, newline));
+                high_counters = _mm256_sub_epi8(high_counters, _mm256_cmpeq_epi8(high, newline));
+            }
+            total = _mm256_add_epi64(total, _mm256_sad_epu8(low_counters, _mm256_setzero_si256()));
+            total = _mm256_add_epi64(total, _mm256_sad_epu8(high_counters, _mm256_setzero_si256()));
+        }
+        std::size_t const vector_count = static_cast<std::size_t>(_mm256_extract_epi64(total, 0))
+                                         + static_cast<std::size_t>(_mm256_extract_epi64(total, 1))
+                                         + static_cast<std::size_t>(_mm256_extract_epi64(total, 2))
+                                         + static_cast<std::size_t>(_mm256_extract_epi64(total, 3));
+        return vector_count + countSSE2(data + i, size - i);
+    }
+#endif
+}
+
+NewlineScanner::Implementation NewlineScanner::best() {
+    static Implementation const implementation = supported(Implementation::AVX2)
+                                                     ? Implementation::AVX2
+                                                     : supported(Implementation::SSE2)
+                                                           ? Implementation::SSE2
+                                                           : Implementation::Memchr;
+    return implementation;
+}
+
+bool NewlineScanner::supported(Implementation implementation) {
+    switch (implementation) {
+#ifdef NEWLINESCANNER_X86
+        case Implementation::AVX2:
+            return __builtin_cpu_supports("avx2");
+        case Implementation::SSE2:
+            return __builtin_cpu_supports("sse2");
+#else
+        case Implementation::AVX2:
+        case Implementation::SSE2:
+            return false;
+#endif
+        case Implementation::Scalar:
+        case Implementation::Memchr:
+        default:
+            return true;
+    }
+}
+
+void NewlineScanner::find(std::string_view data, std::size_t base, std::vector<std::size_t> &out,
+                          Implementation implementation) {
+    switch (implementation) {
+#ifdef NEWLINESCANNER_X86
+        case Implementation::AVX2:
+            findAVX2(data.data(), data.size(), base, out);
+            return;
+        case Implementation::SSE2:
+            findSSE2(data.data(), data.size(), base, out);
+            return;
+#endif
+        case Implementation::Scalar:
+            findScalar(data.data(), data.size(), base, out);
+            return;
+        case Implementation::Memchr:
+        default:
+            findMemchr(data.data(), data.size(), base, out);
+    }
+}
+
+std::size_t NewlineScanner::count(std::string_view data, Implementation implementation) {
+    switch (implementation) {
+#ifdef NEWLINESCANNER_X86
+        case Implementation::AVX2:
+            return countAVX2(data.data(), data.size());
+        case Implementation::SSE2:
+            return countSSE2(data.data(), data.size());
+#endif
+        case Implementation::Scalar:
+            return countScalar(data.data(), data.size());
+        case Implementation::Memchr:
+        default:
+            return countMemchr(data.data(), data.size());
+    }
+}
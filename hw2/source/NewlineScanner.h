@@ -0,0 +1,32 @@
+#ifndef NEWLINESCANNER_H
+#define NEWLINESCANNER_H
+#include <cstddef>
+#include <string_view>
+#include <vector>
+
+
+// Finds and counts '\n' in whole buffers at a time with the widest instructions the CPU has:
+// AVX2 or SSE2 compare 32 or 16 bytes per instruction, memchr and a byte loop are the fallbacks.
+// The implementation is picked once at runtime, the others stay available for tests and benchmarks.
+class NewlineScanner {
+public:
+    enum class Implementation {
+        Scalar,
+        Memchr,
+        SSE2,
+        AVX2
+    };
+
+    static Implementation best();
+
+    static bool supported(Implementation implementation);
+
+    // Appends base + the offset of every '\n' in data to out, in order
+    static void find(std::string_view data, std::size_t base, std::vector<std::size_t> &out,
+                     Implementation implementation = best());
+
+    static std::size_t count(std::string_view data, Implementation implementation = best());
+};
+
+
+#endif //NEWLINESCANNER_H
@@ -0,0 +1,188 @@
+#include <chrono>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "AsyncLogger.h"
+#include "FileHandler.h"
+
+
+class TestAsyncLogger : public ::testing::Test {
+protected:
+    void SetUp() override {
+        temp_file_path = std::filesystem::temp_directory_path() / (
+                             "test_logger_" + std::to_string(std::time(nullptr)) + ".txt");
+        std::filesystem::remove(temp_file_path);
+    }
+
+    void TearDown() override {
+        std::filesystem::remove(temp_file_path);
+    }
+
+    // Lines of every producer "<thread> <i>" must be in the file once each and in order
+    void expectLinesOf(int threads, int lines) const {
+        std::vector<int> next(threads, 0);
+        FileHandler file(temp_file_path.string(), FileHandler::FileMode::Read);
+        for (std::string_view const line: file.lines()) {
+            std::size_t const space = line.find(' ');
+            ASSERT_NE(space, std::string_view::npos);
+            int const thread = std::stoi(std::string(line.substr(0, space)));
+            int const i = std::stoi(std::string(line.substr(space + 1, line.find(' ', space + 1) - space - 1)));
+            ASSERT_EQ(i, next[thread]) << "thread " << thread;
+            ++next[thread];
+        }
+        for (int thread = 0; thread < threads; ++thread) {
+            EXPECT_EQ(next[thread], lines) << "thread " << thread;
+        }
+    }
+
+    std::filesystem::path temp_file_path;
+};
+
+// Тест записи из нескольких потоков: строки каждого потока записаны все и по порядку, длинные строки тоже
+TEST_F(TestAsyncLogger, ManyProducers) {
+    constexpr int THREADS = 4;
+    constexpr int LINES = 20000;
+    {
+        AsyncLogger::Options options;
+        options.capacity = 256;
+        options.overflow = AsyncLogger::Overflow::Block;
+        AsyncLogger logger(temp_file_path, options);
+        std::vector<std::thread> producers;
+        for (int thread = 0; thread < THREADS; ++thread) {
+            producers.emplace_back([&, thread] {
+                for (int i = 0; i < LINES; ++i) {
+                    std::string line = std::to_string(thread) + " " + std::to_string(i);
+                    if (i % 100 == 0) {
+                        line += " " + std::string(AsyncLogger::INLINE_LINE_SIZE * 2, 'x');
+                    }
+                    EXPECT_TRUE(logger.log(line));
+                }
+            });
+        }
+        for (std::thread &producer: producers) {
+            producer.join();
+        }
+        logger.flush();
+        AsyncLogger::Stats const stats = logger.stats();
+        EXPECT_EQ(stats.enqueued, static_cast<std::uint64_t>(THREADS * LINES));
+        EXPECT_EQ(stats.written, stats.enqueued);
+        EXPECT_EQ(stats.dropped, 0u);
+    }
+    expectLinesOf(THREADS, LINES);
+}
+
+// Тест переполнения: лишние строки отбрасываются и учитываются, flush() с интервалом синхронизации ждёт fdatasync
+TEST_F(TestAsyncLogger, DropAndGroupCommit) {
+    AsyncLogger::Options options;
+    options.capacity = 4;
+    options.sync_interval = std::chrono::milliseconds(50);
+    options.idle_wait = std::chrono::milliseconds(100);
+    AsyncLogger logger(temp_file_path, options);
+    int queued = 0;
+    for (int i = 0; i < 10000; ++i) {
+        queued += logger.log("line " + std::to_string(i));
+    }
+    logger.flush();
+    AsyncLogger::Stats const stats = logger.stats();
+    EXPECT_EQ(stats.enqueued, static_cast<std::uint64_t>(queued));
+    EXPECT_EQ(stats.enqueued + stats.dropped, 10000u);
+    EXPECT_GT(stats.dropped, 0u);
+    EXPECT_EQ(stats.written, stats.enqueued);
+    EXPECT_GE(stats.syncs, 1u);
+
+    FileHandler file(temp_file_path.string(), FileHandler::FileMode::Read);
+    EXPECT_EQ(file.countLines(), static_cast<std::size_t>(queued));
+}
+
+// Тест ошибки записи: строки, которые не удалось записать, учитываются как потерянные, а не записанные
+TEST_F(TestAsyncLogger, FailedWrites) {
+    AsyncLogger logger("/dev/full");
+    for (int i = 0; i < 100; ++i) {
+        EXPECT_TRUE(logger.log("line " + std::to_string(i)));
+    }
+    logger.flush();
+    AsyncLogger::Stats const stats = logger.stats();
+    EXPECT_EQ(stats.failed, 100u);
+    EXPECT_EQ(stats.written, 0u);
+}
+
+// Тест ошибки fdatasync: строки записаны, но flush() сообщает, что они не на диске
+TEST_F(TestAsyncLogger, FailedSync) {
+    AsyncLogger::Options options;
+    options.sync_interval = std::chrono::milliseconds(10);
+    AsyncLogger logger("/dev/null", options);
+    for (int i = 0; i < 100; ++i) {
+        EXPECT_TRUE(logger.log("line " + std::to_string(i)));
+    }
+    EXPECT_THROW(logger.flush(), FileHandler::FileSyncException);
+    AsyncLogger::Stats const stats = logger.stats();
+    EXPECT_EQ(stats.written, 100u);
+    EXPECT_EQ(stats.syncs, 0u);
+    EXPECT_GE(stats.sync_failures, 1u);
+}
+
+// Цена log() для производителей при отбрасывании и при ожидании места по сравнению с fdatasync каждой строки;
+// отключено, запускается явно
+TEST_F(TestAsyncLogger, DISABLED_BenchmarkAsyncAppend) {
+    constexpr int THREADS = 4;
+    constexpr int LINES = 250000;
+    std::string const payload(60, '.');
+
+    auto measure = [&](AsyncLogger::Overflow overflow, char const *name) {
+        std::filesystem::remove(temp_file_path);
+        auto const start = std::chrono::steady_clock::now();
+        std::chrono::duration<double, std::nano> producing{};
+        AsyncLogger::Stats stats{};
+        {
+            AsyncLogger::Options options;
+            options.sync_interval = std::chrono::milliseconds(10);
+            options.overflow = overflow;
+            AsyncLogger logger(temp_file_path, options);
+            std::vector<std::thread> producers;
+            for (int thread = 0; thread < THREADS; ++thread) {
+                producers.emplace_back([&, thread] {
+                    std::string line = std::to_string(thread) + " ";
+                    std::size_t const prefix = line.size();
+                    for (int i = 0; i < LINES; ++i) {
+                        line.resize(prefix);
+                        line += std::to_string(i);
+                        line += payload;
+                        logger.log(line);
+                    }
+                });
+            }
+            for (std::thread &producer: producers) {
+                producer.join();
+            }
+            producing = std::chrono::steady_clock::now() - start;
+            logger.flush();
+            stats = logger.stats();
+        }
+        std::chrono::duration<double, std::milli> const total = std::chrono::steady_clock::now() - start;
+        EXPECT_EQ(stats.written + stats.dropped, static_cast<std::uint64_t>(THREADS * LINES));
+        std::cout << name << ": " << THREADS << " x " << LINES << " lines, " << producing.count() / (THREADS * LINES)
+                  << " ns per log() call, sampled enqueue mean " << stats.enqueue_mean_ns << " ns, max "
+                  << stats.enqueue_max_ns << " ns; " << stats.dropped << " dropped, " << stats.batches
+                  << " batches, " << stats.syncs << " syncs, " << total.count() << " ms in all" << std::endl;
+    };
+    measure(AsyncLogger::Overflow::Drop, "drop");
+    measure(AsyncLogger::Overflow::Block, "block");
+
+    std::filesystem::remove(temp_file_path);
+    auto const start = std::chrono::steady_clock::now();
+    {
+        FileHandler file(temp_file_path.string(), FileHandler::FileMode::Append,
+                         {0, FileHandler::Durability::PerLine});
+        for (int i = 0; i < 1000; ++i) {
+            file.writeLine(std::to_string(i) + payload);
+        }
+    }
+    std::chrono::duration<double, std::nano> const per_line_sync = std::chrono::steady_clock::now() - start;
+    std::cout << "FileHandler with fdatasync per line: " << per_line_sync.count() / 1000 << " ns per line"
+              << std::endl;
+}
@@ -1,5 +1,14 @@
+#include <atomic>
+#include <chrono>
 #include <filesystem>
 #include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/stat.h>
 
 #include <gtest/gtest.h>
 
@@ -17,6 +26,7 @@ protected:
         if (std::filesystem::exists(temp_file_path)) {
             std::filesystem::remove(temp_file_path);
         }
+        std::filesystem::remove(FileHandler::indexPath(temp_file_path));
     }
 
     void createTestFile(const std::vector<std::string_view> &lines) const {
@@ -97,3 +107,442 @@ TEST_F(TestFileHandler, WriteToReadOnlyFile) {
     FileHandler file(temp_file_path.string(), FileHandler::FileMode::Read);
     EXPECT_THROW(file.writeLine("..."), FileHandler::FileWriteException);
 }
+
+// Тест буферизованной записи: строки попадают в файл только после flush()
+TEST_F(TestFileHandler, BufferedWriteFlush) {
+    FileHandler file(temp_file_path.string(), FileHandler::FileMode::Write,
+                     {FileHandler::DEFAULT_BUFFER_SIZE});
+    ASSERT_NO_THROW(file.writeLine("line1"));
+    ASSERT_NO_THROW(file.writeLine("line2"));
+    EXPECT_EQ(std::filesystem::file_size(temp_file_path), 0);
+
+    ASSERT_NO_THROW(file.flush());
+    std::ifstream in(temp_file_path);
+    std::string line;
+    ASSERT_TRUE(std::getline(in, line));
+    EXPECT_EQ(line, "line1");
+    ASSERT_TRUE(std::getline(in, line));
+    EXPECT_EQ(line, "line2");
+    EXPECT_FALSE(std::getline(in, line));
+}
+
+// Тест записи пачки строк и синхронизации с диском
+TEST_F(TestFileHandler, WriteLinesAndSync) {
+    std::vector<std::string> const lines = {"line1", "", "line3"};
+    {
+        FileHandler file(temp_file_path.string(), FileHandler::FileMode::Write,
+                         {4, FileHandler::Durability::PerBatch});
+        ASSERT_NO_THROW(file.writeLines(lines));
+        ASSERT_NO_THROW(file.writeLine("line4"));
+        ASSERT_NO_THROW(file.sync());
+    }
+    FileHandler file(temp_file_path.string(), FileHandler::FileMode::Read);
+    EXPECT_EQ(file.readLine(), "line1");
+    EXPECT_EQ(file.readLine(), "");
+    EXPECT_EQ(file.readLine(), "line3");
+    EXPECT_EQ(file.readLine(), "line4");
+    EXPECT_FALSE(file.readLine().has_value());
+}
+
+// Тест дозаписи: буфер сбрасывается при закрытии файла
+TEST_F(TestFileHandler, BufferedAppendOnClose) {
+    createTestFile({"line1"});
+    {
+        FileHandler file(temp_file_path.string(), FileHandler::FileMode::Append,
+                         {FileHandler::DEFAULT_BUFFER_SIZE, FileHandler::Durability::OnClose});
+        std::vector<std::string_view> const lines = {"line2", "line3"};
+        ASSERT_NO_THROW(file.writeLines(lines));
+    }
+    FileHandler file(temp_file_path.string(), FileHandler::FileMode::Read);
+    EXPECT_EQ(file.readLine(), "line1");
+    EXPECT_EQ(file.readLine(), "line2");
+    EXPECT_EQ(file.readLine(), "line3");
+    EXPECT_FALSE(file.readLine().has_value());
+}
+
+// Тест записи строк через writev без копирования: после буферизованных строк, больше IOV_MAX частей, с индексом
+TEST_F(TestFileHandler, WriteLinesDirect) {
+    std::vector<std::string> expected = {"line0"};
+    for (int i = 1; i < 3000; ++i) {
+        expected.push_back(i % 7 == 0 ? std::string() : "line" + std::to_string(i));
+    }
+    {
+        FileHandler file(temp_file_path.string(), FileHandler::FileMode::Write,
+                         {FileHandler::DEFAULT_BUFFER_SIZE});
+        file.enableLineIndex();
+        ASSERT_NO_THROW(file.writeLine(expected.front()));
+        std::vector<std::string_view> const lines(expected.begin() + 1, expected.end());
+        EXPECT_EQ(file.writeLinesDirect(lines), lines.size());
+    }
+
+    LineIndex index;
+    std::uint64_t const file_size = std::filesystem::file_size(temp_file_path);
+    struct stat st{};
+    ASSERT_EQ(stat(temp_file_path.c_str(), &st), 0);
+    ASSERT_TRUE(index.load(FileHandler::indexPath(temp_file_path), file_size,
+        static_cast<std::int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec));
+    EXPECT_EQ(index.lineCount(), expected.size());
+
+    FileHandler file(temp_file_path.string(), FileHandler::FileMode::Read);
+    std::vector<std::string> lines;
+    for (std::string_view const line: file.lines()) {
+        lines.emplace_back(line);
+    }
+    EXPECT_EQ(lines, expected);
+}
+
+// Сравнение записи со сбросом каждой строки и буферизованной записи
+TEST_F(TestFileHandler, BenchmarkBufferedWrite) {
+    constexpr int LINES = 200000;
+    std::string const line(40, 'x');
+    auto measure = [&](FileHandler::WriteOptions const &options) {
+        auto const start = std::chrono::steady_clock::now();
+        {
+            FileHandler file(temp_file_path.string(), FileHandler::FileMode::Write, options);
+            for (int i = 0; i < LINES; ++i) {
+                file.writeLine(line);
+            }
+        }
+        std::chrono::duration<double, std::milli> const elapsed = std::chrono::steady_clock::now() - start;
+        EXPECT_EQ(std::filesystem::file_size(temp_file_path), LINES * (line.size() + 1));
+        return elapsed.count();
+    };
+
+    double const per_line = measure({});
+    double const buffered = measure({FileHandler::DEFAULT_BUFFER_SIZE});
+    double const buffered_sync = measure({FileHandler::DEFAULT_BUFFER_SIZE, FileHandler::Durability::OnClose});
+    std::cout << LINES << " lines: per-line write " << per_line << " ms, buffered " << buffered
+              << " ms, buffered + fdatasync on close " << buffered_sync << " ms" << std::endl;
+}
+
+// Тест чтения строк через lines(): последняя строка без перевода строки тоже возвращается
+TEST_F(TestFileHandler, ReadLinesRange) {
+    {
+        std::ofstream out(temp_file_path, std::ios::binary);
+        out << "line1\n\nline3";
+    }
+    FileHandler file(temp_file_path.string(), FileHandler::FileMode::Read);
+    std::vector<std::string_view> lines;
+    for (std::string_view const line: file.lines()) {
+        lines.push_back(line);
+    }
+    std::vector<std::string_view> const expected = {"line1", "", "line3"};
+    EXPECT_EQ(lines, expected);
+    EXPECT_FALSE(file.readLineView().has_value());
+}
+
+// Тест чтения из канала, который нельзя отобразить в память: строки длиннее буфера чтения
+TEST_F(TestFileHandler, ReadLinesFromPipe) {
+    ASSERT_EQ(mkfifo(temp_file_path.c_str(), 0600), 0);
+    std::string const long_line(3 * FileHandler::READ_CHUNK_SIZE + 7, 'x');
+    std::thread writer([&] {
+        std::ofstream out(temp_file_path, std::ios::binary);
+        out << "line1\n" << long_line << "\nline3\n";
+    });
+
+    FileHandler file(temp_file_path.string(), FileHandler::FileMode::Read);
+    EXPECT_EQ(file.readLine(), "line1");
+    EXPECT_EQ(file.readLineView(), long_line);
+    std::vector<std::string> rest;
+    for (std::string_view const line: file.lines()) {
+        rest.emplace_back(line);
+    }
+    writer.join();
+    EXPECT_EQ(rest, std::vector<std::string>{"line3"});
+}
+
+// Сравнение readLine() с копированием строки и lines() без копирования; отключено, запускается явно
+TEST_F(TestFileHandler, DISABLED_BenchmarkReadLines) {
+    constexpr int LINES = 500000;
+    {
+        FileHandler file(temp_file_path.string(), FileHandler::FileMode::Write,
+                         {FileHandler::DEFAULT_BUFFER_SIZE});
+        std::string const line(60, 'x');
+        for (int i = 0; i < LINES; ++i) {
+            file.writeLine(line);
+        }
+    }
+
+    auto const start = std::chrono::steady_clock::now();
+    std::size_t copied = 0;
+    {
+        FileHandler file(temp_file_path.string(), FileHandler::FileMode::Read);
+        while (std::optional<std::string> const line = file.readLine()) {
+            copied += line->size();
+        }
+    }
+    auto const middle = std::chrono::steady_clock::now();
+    std::size_t viewed = 0;
+    {
+        FileHandler file(temp_file_path.string(), FileHandler::FileMode::Read);
+        for (std::string_view const line: file.lines()) {
+            viewed += line.size();
+        }
+    }
+    auto const end = std::chrono::steady_clock::now();
+
+    EXPECT_EQ(copied, viewed);
+    std::chrono::duration<double, std::milli> const read_line = middle - start, lines = end - middle;
+    std::cout << LINES << " lines: readLine " << read_line.count() << " ms, lines() " << lines.count() << " ms"
+              << std::endl;
+}
+
+// Тест чтения файла с переводами строк "\r\n" и подсчёта строк через countLines(), после которого строк не остаётся
+TEST_F(TestFileHandler, ReadCrlfLinesAndCount) {
+    {
+        std::ofstream out(temp_file_path, std::ios::binary);
+        out << "line1\r\n\r\nline3\rx\r\nline4";
+    }
+    {
+        FileHandler file(temp_file_path.string(), FileHandler::FileMode::Read);
+        EXPECT_EQ(file.readLine(), "line1");
+        std::vector<std::string_view> lines;
+        for (std::string_view const line: file.lines()) {
+            lines.push_back(line);
+        }
+        std::vector<std::string_view> const expected = {"", "line3\rx", "line4"};
+        EXPECT_EQ(lines, expected);
+        EXPECT_EQ(file.countLines(), 0u);
+    }
+    FileHandler file(temp_file_path.string(), FileHandler::FileMode::Read);
+    EXPECT_EQ(file.readLine(), "line1");
+    EXPECT_EQ(file.countLines(), 3u);
+    EXPECT_FALSE(file.readLineView().has_value());
+    EXPECT_EQ(file.countLines(), 0u);
+}
+
+// Тест подсчёта строк в канале: countLines() дочитывает его до конца
+TEST_F(TestFileHandler, CountLinesFromPipe) {
+    ASSERT_EQ(mkfifo(temp_file_path.c_str(), 0600), 0);
+    std::thread writer([&] {
+        std::ofstream out(temp_file_path, std::ios::binary);
+        for (int i = 0; i < 100000; ++i) {
+            out << "line" << i << "\n";
+        }
+        out << "last";
+    });
+
+    FileHandler file(temp_file_path.string(), FileHandler::FileMode::Read);
+    EXPECT_EQ(file.readLine(), "line0");
+    EXPECT_EQ(file.countLines(), 100000u);
+    EXPECT_FALSE(file.readLineView().has_value());
+    writer.join();
+}
+
+// Тест параллельной обработки: результаты идут в порядке файла, исключение из потока передаётся вызывающему
+TEST_F(TestFileHandler, MapChunksKeepsOrder) {
+    std::vector<std::string> expected;
+    {
+        std::ofstream out(temp_file_path, std::ios::binary);
+        for (int i = 0; i < 10000; ++i) {
+            expected.push_back("line" + std::to_string(i) + std::string(i % 17, 'x'));
+            out << expected.back() << (i % 3 == 0 ? "\r\n" : "\n");
+        }
+        expected.emplace_back("last");
+        out << "last";
+    }
+
+    FileHandler file(temp_file_path.string(), FileHandler::FileMode::Read);
+    EXPECT_EQ(file.readLine(), expected.front());
+    std::vector<std::vector<std::string>> const chunks = file.mapChunks(
+        [](FileHandler::Chunk const &chunk) {
+            std::vector<std::string> lines;
+            chunk.forEachLine([&](std::string_view line) {
+                lines.emplace_back(line);
+            });
+            EXPECT_EQ(lines.size(), chunk.countLines());
+            return lines;
+        }, {3, 7});
+    EXPECT_FALSE(file.readLineView().has_value());
+
+    EXPECT_EQ(chunks.size(), 7u);
+    std::vector<std::string> lines = {expected.front()};
+    for (std::vector<std::string> const &chunk: chunks) {
+        lines.insert(lines.end(), chunk.begin(), chunk.end());
+    }
+    EXPECT_EQ(lines, expected);
+
+    FileHandler again(temp_file_path.string(), FileHandler::FileMode::Read);
+    EXPECT_THROW(again.processChunks([](FileHandler::Chunk const &chunk) {
+        if (chunk.index == 5) {
+            throw std::runtime_error("chunk");
+        }
+    }, {2, 7}), std::runtime_error);
+}
+
+// Тест параллельной обработки канала
+TEST_F(TestFileHandler, ProcessChunksFromPipe) {
+    ASSERT_EQ(mkfifo(temp_file_path.c_str(), 0600), 0);
+    std::thread writer([&] {
+        std::ofstream out(temp_file_path, std::ios::binary);
+        for (int i = 0; i < 100000; ++i) {
+            out << "line" << i << "\n";
+        }
+    });
+
+    FileHandler file(temp_file_path.string(), FileHandler::FileMode::Read);
+    std::atomic<std::size_t> count{0};
+    file.forEachLineParallel([&](std::string_view line) {
+        EXPECT_EQ(line.substr(0, 4), "line");
+        ++count;
+    }, {4, 16});
+    writer.join();
+    EXPECT_EQ(count, 100000u);
+}
+
+// Подсчёт строк с подстрокой в одном потоке и в потоке на каждое ядро; отключено, запускается явно
+TEST_F(TestFileHandler, DISABLED_BenchmarkParallelLines) {
+    constexpr int LINES = 2000000;
+    {
+        FileHandler file(temp_file_path.string(), FileHandler::FileMode::Write,
+                         {FileHandler::DEFAULT_BUFFER_SIZE});
+        for (int i = 0; i < LINES; ++i) {
+            file.writeLine("request " + std::to_string(i) + (i % 10 == 0 ? " error" : " ok") + std::string(40, '.'));
+        }
+    }
+
+    auto measure = [&](std::size_t threads) {
+        auto const start = std::chrono::steady_clock::now();
+        FileHandler file(temp_file_path.string(), FileHandler::FileMode::Read);
+        std::vector<std::size_t> const counts = file.mapChunks([](FileHandler::Chunk const &chunk) {
+            std::size_t count = 0;
+            chunk.forEachLine([&](std::string_view line) {
+                count += line.find("error") != std::string_view::npos;
+            });
+            return count;
+        }, {threads});
+        std::size_t total = 0;
+        for (std::size_t const count: counts) {
+            total += count;
+        }
+        EXPECT_EQ(total, static_cast<std::size_t>(LINES / 10));
+        std::chrono::duration<double, std::milli> const elapsed = std::chrono::steady_clock::now() - start;
+        return elapsed.count();
+    };
+
+    measure(1);
+    std::size_t const cores = std::max(1u, std::thread::hardware_concurrency());
+    double const single = measure(1);
+    double const parallel = measure(cores);
+    std::cout << LINES << " lines: 1 thread " << single << " ms, " << cores << " threads " << parallel << " ms"
+              << std::endl;
+}
+
+// Тест доступа к строке по номеру: индекс сохраняется рядом с файлом и перестраивается после изменения файла
+TEST_F(TestFileHandler, ReadLineByIndex) {
+    std::vector<std::string> expected;
+    {
+        std::ofstream out(temp_file_path, std::ios::binary);
+        for (int i = 0; i < 1000; ++i) {
+            expected.push_back(std::to_string(i) + std::string(i % 300, 'x'));
+            out << expected.back() << (i % 2 == 0 ? "\r\n" : "\n");
+        }
+    }
+    std::filesystem::path const index_path = FileHandler::indexPath(temp_file_path);
+    {
+        FileHandler file(temp_file_path.string(), FileHandler::FileMode::Read);
+        file.enableLineIndex(16);
+        EXPECT_EQ(file.lineCount(), expected.size());
+        for (std::size_t n = expected.size(); n-- > 0;) {
+            EXPECT_EQ(file.readLine(n), expected[n]);
+        }
+        EXPECT_FALSE(file.readLine(expected.size()).has_value());
+        EXPECT_EQ(file.readLine(), expected[0]);
+    }
+    ASSERT_TRUE(std::filesystem::exists(index_path));
+    auto const saved = std::filesystem::last_write_time(index_path);
+    {
+        FileHandler file(temp_file_path.string(), FileHandler::FileMode::Read);
+        file.enableLineIndex();
+        EXPECT_EQ(file.readLine(999), expected[999]);
+    }
+    EXPECT_EQ(std::filesystem::last_write_time(index_path), saved);
+
+    {
+        std::ofstream out(temp_file_path, std::ios::binary | std::ios::app);
+        out << "last";
+    }
+    FileHandler file(temp_file_path.string(), FileHandler::FileMode::Read);
+    file.enableLineIndex();
+    EXPECT_EQ(file.lineCount(), expected.size() + 1);
+    EXPECT_EQ(file.readLine(expected.size()), "last");
+}
+
+// Тест дозаписи с индексом: индекс дополняется записанными строками, а не строится заново
+TEST_F(TestFileHandler, AppendExtendsLineIndex) {
+    createTestFile({"line0", "line1"});
+    for (int round = 0; round < 3; ++round) {
+        FileHandler file(temp_file_path.string(), FileHandler::FileMode::Append,
+                         {FileHandler::DEFAULT_BUFFER_SIZE});
+        file.enableLineIndex(4);
+        for (int i = 0; i < 10; ++i) {
+            file.writeLine("line" + std::to_string(2 + round * 10 + i));
+        }
+    }
+
+    LineIndex index;
+    std::uint64_t const file_size = std::filesystem::file_size(temp_file_path);
+    struct stat st{};
+    ASSERT_EQ(stat(temp_file_path.c_str(), &st), 0);
+    ASSERT_TRUE(index.load(FileHandler::indexPath(temp_file_path), file_size,
+        static_cast<std::int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec));
+    EXPECT_EQ(index.lineCount(), 32u);
+
+    FileHandler file(temp_file_path.string(), FileHandler::FileMode::Read);
+    file.enableLineIndex();
+    EXPECT_EQ(file.lineCount(), 32u);
+    for (std::size_t n = 0; n < 32; ++n) {
+        EXPECT_EQ(file.readLine(n), "line" + std::to_string(n));
+    }
+}
+
+// Построение, загрузка индекса и переход к случайным строкам по сравнению с последовательным чтением;
+// отключено, запускается явно
+TEST_F(TestFileHandler, DISABLED_BenchmarkLineIndex) {
+    constexpr int LINES = 1000000;
+    constexpr int LOOKUPS = 100000;
+    {
+        FileHandler file(temp_file_path.string(), FileHandler::FileMode::Write,
+                         {FileHandler::DEFAULT_BUFFER_SIZE});
+        for (int i = 0; i < LINES; ++i) {
+            file.writeLine("line " + std::to_string(i) + std::string(i % 100, '.'));
+        }
+    }
+    using Milliseconds = std::chrono::duration<double, std::milli>;
+
+    auto start = std::chrono::steady_clock::now();
+    {
+        FileHandler file(temp_file_path.string(), FileHandler::FileMode::Read);
+        file.enableLineIndex();
+        EXPECT_EQ(file.lineCount(), static_cast<std::size_t>(LINES));
+    }
+    Milliseconds const build = std::chrono::steady_clock::now() - start;
+
+    FileHandler file(temp_file_path.string(), FileHandler::FileMode::Read);
+    file.enableLineIndex();
+    start = std::chrono::steady_clock::now();
+    EXPECT_EQ(file.lineCount(), static_cast<std::size_t>(LINES));
+    Milliseconds const load = std::chrono::steady_clock::now() - start;
+
+    std::mt19937 generator(1);
+    std::uniform_int_distribution<std::size_t> line(0, LINES - 1);
+    std::size_t found = 0;
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < LOOKUPS; ++i) {
+        found += file.readLineView(line(generator))->size();
+    }
+    std::chrono::duration<double, std::nano> const lookup = std::chrono::steady_clock::now() - start;
+    EXPECT_GT(found, 0u);
+
+    start = std::chrono::steady_clock::now();
+    FileHandler sequential(temp_file_path.string(), FileHandler::FileMode::Read);
+    for (int i = 0; i < LINES / 2; ++i) {
+        sequential.readLineView();
+    }
+    Milliseconds const skip = std::chrono::steady_clock::now() - start;
+
+    std::cout << LINES << " lines: index " << std::filesystem::file_size(FileHandler::indexPath(temp_file_path))
+              << " bytes, built in " << build.count() << " ms, loaded in " << load.count() << " ms, readLine(n) "
+              << lookup.count() / LOOKUPS << " ns; reading up to line " << LINES / 2 << " " << skip.count() << " ms"
+              << std::endl;
+}
@@ -0,0 +1,51 @@
+#include <filesystem>
+#include <fstream>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "LineIndex.h"
+
+
+// Тест смещений строк: длинные строки кодируются несколькими байтами, последняя строка без перевода строки
+TEST(TestLineIndex, Offsets) {
+    std::string const text = "a\n" + std::string(100000, 'b') + "\n\nc\n" + std::string(200, 'd');
+    LineIndex index(2);
+    index.append(text.substr(0, 7));
+    index.append(text.substr(7));
+    EXPECT_EQ(index.size(), text.size());
+    ASSERT_EQ(index.lineCount(), 5u);
+    EXPECT_EQ(index.offset(0), 0u);
+    EXPECT_EQ(index.offset(1), 2u);
+    EXPECT_EQ(index.offset(2), 100003u);
+    EXPECT_EQ(index.offset(3), 100004u);
+    EXPECT_EQ(index.offset(4), 100006u);
+
+    LineIndex empty;
+    EXPECT_EQ(empty.lineCount(), 0u);
+    empty.append("\n");
+    EXPECT_EQ(empty.lineCount(), 1u);
+}
+
+// Тест сохранения: индекс загружается только для того же размера и времени изменения файла
+TEST(TestLineIndex, SaveAndLoad) {
+    std::filesystem::path const index_path = std::filesystem::temp_directory_path() / "test_line_index.idx";
+    LineIndex index(3);
+    for (int i = 0; i < 100; ++i) {
+        index.append(std::string(i * 10, 'x') + "\n");
+    }
+    ASSERT_TRUE(index.save(index_path, 42));
+
+    LineIndex loaded;
+    EXPECT_FALSE(loaded.load(index_path, index.size() + 1, 42));
+    EXPECT_FALSE(loaded.load(index_path, index.size(), 43));
+    ASSERT_TRUE(loaded.load(index_path, index.size(), 42));
+    ASSERT_EQ(loaded.lineCount(), index.lineCount());
+    for (std::size_t line = 0; line < index.lineCount(); ++line) {
+        EXPECT_EQ(loaded.offset(line), index.offset(line));
+    }
+
+    std::filesystem::resize_file(index_path, std::filesystem::file_size(index_path) - 1);
+    EXPECT_FALSE(LineIndex().load(index_path, index.size(), 42));
+    std::filesystem::remove(index_path);
+}
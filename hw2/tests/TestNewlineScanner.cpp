@@ -0,0 +1,99 @@
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "NewlineScanner.h"
+
+
+namespace {
+    std::vector<NewlineScanner::Implementation> const IMPLEMENTATIONS = {
+        NewlineScanner::Implementation::Scalar,
+        NewlineScanner::Implementation::Memchr,
+        NewlineScanner::Implementation::SSE2,
+        NewlineScanner::Implementation::AVX2
+    };
+
+    char const *name(NewlineScanner::Implementation implementation) {
+        switch (implementation) {
+            case NewlineScanner::Implementation::Scalar:
+                return "scalar";
+            case NewlineScanner::Implementation::Memchr:
+                return "memchr";
+            case NewlineScanner::Implementation::SSE2:
+                return "SSE2";
+            case NewlineScanner::Implementation::AVX2:
+            default:
+                return "AVX2";
+        }
+    }
+
+    std::string randomText(std::size_t size, int newline_percent, unsigned seed) {
+        std::mt19937 generator(seed);
+        std::uniform_int_distribution<int> percent(0, 99);
+        std::uniform_int_distribution<int> byte(0, 255);
+        std::string text(size, ' ');
+        for (char &c: text) {
+            c = percent(generator) < newline_percent ? '\n' : static_cast<char>(byte(generator));
+        }
+        return text;
+    }
+}
+
+// Тест всех доступных реализаций против побайтовой на разных длинах и смещениях
+TEST(TestNewlineScanner, ImplementationsAgree) {
+    std::string const text = randomText(70000, 5, 1);
+    for (NewlineScanner::Implementation const implementation: IMPLEMENTATIONS) {
+        if (!NewlineScanner::supported(implementation)) {
+            continue;
+        }
+        for (std::size_t offset = 0; offset < 70; offset += 3) {
+            for (std::size_t size: {0ul, 1ul, 15ul, 16ul, 31ul, 63ul, 64ul, 65ul, 1000ul, 69000ul}) {
+                std::string_view const data(text.data() + offset, size);
+                std::vector<std::size_t> expected, found;
+                NewlineScanner::find(data, 100, expected, NewlineScanner::Implementation::Scalar);
+                NewlineScanner::find(data, 100, found, implementation);
+                EXPECT_EQ(found, expected) << name(implementation) << " offset " << offset << " size " << size;
+                EXPECT_EQ(NewlineScanner::count(data, implementation), expected.size())
+                    << name(implementation) << " offset " << offset << " size " << size;
+            }
+        }
+    }
+}
+
+// Тест подсчёта, когда счётчики байтов переполнились бы без промежуточного сложения
+TEST(TestNewlineScanner, CountOnlyNewlines) {
+    std::string const text(1 << 20, '\n');
+    for (NewlineScanner::Implementation const implementation: IMPLEMENTATIONS) {
+        if (NewlineScanner::supported(implementation)) {
+            EXPECT_EQ(NewlineScanner::count(text, implementation), text.size()) << name(implementation);
+        }
+    }
+}
+
+// Скорость подсчёта и поиска переводов строк каждой реализацией; отключено, запускается явно
+TEST(TestNewlineScanner, DISABLED_BenchmarkScan) {
+    std::string const text = randomText(64 << 20, 2, 2);
+    std::vector<std::size_t> newlines;
+    std::cout << "best: " << name(NewlineScanner::best()) << std::endl;
+    for (NewlineScanner::Implementation const implementation: IMPLEMENTATIONS) {
+        if (!NewlineScanner::supported(implementation)) {
+            continue;
+        }
+        auto const start = std::chrono::steady_clock::now();
+        std::size_t const count = NewlineScanner::count(text, implementation);
+        auto const middle = std::chrono::steady_clock::now();
+        newlines.clear();
+        NewlineScanner::find(text, 0, newlines, implementation);
+        auto const end = std::chrono::steady_clock::now();
+
+        EXPECT_EQ(count, newlines.size());
+        std::chrono::duration<double> const counting = middle - start, finding = end - middle;
+        double const gib = static_cast<double>(text.size()) / (1 << 30);
+        std::cout << name(implementation) << ": count " << gib / counting.count() << " GiB/s, find "
+                  << gib / finding.count() << " GiB/s" << std::endl;
+    }
+}
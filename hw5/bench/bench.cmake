@@ -0,0 +1,16 @@
+SET(BENCH_SOURCE_FILES
+        bench/scanner_bench.cpp
+        server/BatchEvaluator.h
+        server/Calculator.h
+        server/ExpressionScanner.h
+        client/ExprGenerator.h
+)
+
+add_executable(scanner_bench ${BENCH_SOURCE_FILES})
+target_include_directories(scanner_bench PRIVATE server client)
+
+if (CMAKE_BUILD_TYPE MATCHES Debug)
+    target_compile_options(scanner_bench PRIVATE -g -O0 -Wall -Wextra -Werror)
+elseif (CMAKE_BUILD_TYPE MATCHES Release)
+    target_compile_options(scanner_bench PRIVATE -O3 -DNDEBUG)
+endif ()
@@ -0,0 +1,150 @@
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "BatchEvaluator.h"
+#include "Calculator.h"
+#include "ExprGenerator.h"
+#include "ExpressionScanner.h"
+
+
+// Compares the iostream evaluation path with ExpressionScanner (scalar and AVX2 classification)
+// folding every expression on its own, and with the scanner feeding BatchEvaluator, on
+// ExprGenerator corpora of several expression lengths. Usage: scanner_bench [<corpus MiB>]
+
+std::string make_corpus(int operands, std::size_t size) {
+    ExprGenerator generator(42);
+    std::string corpus;
+    while (corpus.size() < size) {
+        corpus += generator.gen_expr(operands);
+        corpus += ' ';
+    }
+    return corpus;
+}
+
+// Mixes results in order, so a wrong or missing result changes the checksum
+void mix(unsigned long &checksum, long result) {
+    checksum = checksum * 31 + static_cast<unsigned long>(result);
+}
+
+unsigned long run_iostream(std::string const &corpus) {
+    unsigned long checksum = 0;
+    std::istringstream iss(corpus);
+    std::string token;
+    while (iss >> token) {
+        mix(checksum, Calculator::evaluate(token));
+    }
+    return checksum;
+}
+
+// Same as the server: tokens are folded one by one, untokenized text goes through iostreams
+long fold(std::string_view text, ExpressionScanner::Token const *tokens, std::size_t count) {
+    if (count == 0) {
+        return Calculator::evaluate(std::string(text));
+    }
+    Calculator::Accumulator acc;
+    for (std::size_t i = 0; i < count; ++i) {
+        acc.apply(tokens[i].op, tokens[i].operand);
+    }
+    return acc.value();
+}
+
+unsigned long run_scanner(ExpressionScanner &scanner, std::string const &corpus) {
+    unsigned long checksum = 0;
+    scanner.scan(corpus, [&checksum](std::string_view text, ExpressionScanner::Token const *tokens,
+                                     std::size_t count) {
+        mix(checksum, fold(text, tokens, count));
+    });
+    return checksum;
+}
+
+unsigned long run_batch(ExpressionScanner &scanner, BatchEvaluator &batch, std::string const &corpus) {
+    static std::vector<long> results;
+    results.clear();
+    auto store = [](std::size_t index, long value) { results[index] = value; };
+    scanner.scan(corpus, [&batch, &store](std::string_view text, ExpressionScanner::Token const *tokens,
+                                          std::size_t count) {
+        results.push_back(0);
+        if (!batch.add(tokens, count, results.size() - 1, store)) {
+            results.back() = fold(text, tokens, count);
+        }
+    });
+    batch.flush(store);
+
+    unsigned long checksum = 0;
+    for (long const result: results) {
+        mix(checksum, result);
+    }
+    return checksum;
+}
+
+// Best of several runs, in MiB/s
+template<typename Run>
+double throughput(std::string const &corpus, unsigned long &checksum, Run &&run) {
+    double best = 0;
+    for (int attempt = 0; attempt < 5; ++attempt) {
+        auto const start = std::chrono::steady_clock::now();
+        checksum = run();
+        std::chrono::duration<double> const elapsed = std::chrono::steady_clock::now() - start;
+        best = std::max(best, static_cast<double>(corpus.size()) / (1 << 20) / elapsed.count());
+    }
+    return best;
+}
+
+// Expressions whose intermediate values leave the range the AVX2 division takes through doubles,
+// repeated so that they fill whole batches
+std::string edge_corpus() {
+    std::string corpus;
+    for (int i = 0; i < 64; ++i) {
+        for (char const *expression: {"-4294967296*2147483648/2", "-4294967296*2147483648/-3",
+                                      "4294967296*2147483648/7", "3/-4294967296*2147483648"}) {
+            corpus += expression;
+            corpus += ' ';
+        }
+    }
+    return corpus;
+}
+
+int main(int argc, char *argv[]) {
+    std::size_t const corpus_size = (argc > 1 ? std::stoul(argv[1]) : 8) << 20;
+    ExpressionScanner scalar(false), simd(true);
+    BatchEvaluator scalar_batch(false), simd_batch(true);
+
+    std::string const edges = edge_corpus();
+    unsigned long const edge_sum = run_iostream(edges);
+    if (run_batch(scalar, scalar_batch, edges) != edge_sum || run_batch(simd, simd_batch, edges) != edge_sum) {
+        std::cerr << "checksum mismatch for overflowing expressions" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::cout << "corpus " << (corpus_size >> 20) << " MiB, AVX2 " << (simd.simd() ? "on" : "unavailable") << '\n';
+    std::cout << std::setw(9) << "operands" << std::setw(14) << "iostream MB/s" << std::setw(14) << "scalar MB/s"
+              << std::setw(14) << "avx2 MB/s" << std::setw(18) << "batch scalar MB/s" << std::setw(16)
+              << "batch avx2 MB/s" << std::setw(10) << "speedup" << '\n';
+
+    for (int const operands: {1, 3, 10, 30, 100, 300}) {
+        std::string const corpus = make_corpus(operands, corpus_size);
+        unsigned long expected = 0, scalar_sum = 0, simd_sum = 0, scalar_batch_sum = 0, simd_batch_sum = 0;
+        double const base = throughput(corpus, expected, [&] { return run_iostream(corpus); });
+        double const fast_scalar = throughput(corpus, scalar_sum, [&] { return run_scanner(scalar, corpus); });
+        double const fast_simd = throughput(corpus, simd_sum, [&] { return run_scanner(simd, corpus); });
+        double const batched_scalar = throughput(corpus, scalar_batch_sum, [&] {
+            return run_batch(scalar, scalar_batch, corpus);
+        });
+        double const batched_simd = throughput(corpus, simd_batch_sum, [&] {
+            return run_batch(simd, simd_batch, corpus);
+        });
+        if (scalar_sum != expected || simd_sum != expected || scalar_batch_sum != expected
+            || simd_batch_sum != expected) {
+            std::cerr << "checksum mismatch for " << operands << " operands" << std::endl;
+            return EXIT_FAILURE;
+        }
+        std::cout << std::fixed << std::setprecision(1) << std::setw(9) << operands << std::setw(14) << base
+                  << std::setw(14) << fast_scalar << std::setw(14) << fast_simd << std::setw(18) << batched_scalar
+                  << std::setw(16) << batched_simd << std::setw(9) << batched_simd / base << "x" << '\n';
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,73 @@
+#ifndef BINARYPROTOCOL_H
+#define BINARYPROTOCOL_H
+
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+
+// Client half of the server's opt-in binary protocol: the request starts with MAGIC and carries
+// one frame per expression, varint(payload size) payload, where
+//   payload := varint(zigzag(operand)) { varint(zigzag(operand) << 2 | opcode) }
+// and opcodes 0..3 stand for + - * /. The reply is varint(zigzag(result)) per expression.
+class BinaryProtocol {
+    static void write_varint(std::string &out, std::uint64_t value) {
+        while (value >= 0x80) {
+            out.push_back(static_cast<char>(value | 0x80));
+            value >>= 7;
+        }
+        out.push_back(static_cast<char>(value));
+    }
+
+    static std::uint64_t zigzag(long value) {
+        return static_cast<std::uint64_t>(value) << 1 ^ static_cast<std::uint64_t>(value >> 63);
+    }
+
+public:
+    static constexpr unsigned char MAGIC = 0xCA;
+
+    // Encodes space separated expressions like the ones produced by ExprGenerator
+    static std::string encode(std::string const &expressions) {
+        std::string out(1, static_cast<char>(MAGIC));
+        std::string payload;
+        std::istringstream expressions_stream(expressions);
+        std::string expression;
+        while (expressions_stream >> expression) {
+            std::istringstream ss(expression);
+            long num = 0;
+            char op;
+
+            payload.clear();
+            ss >> num;
+            write_varint(payload, zigzag(num));
+            while (ss >> op >> num) {
+                std::uint64_t const code = op == '+' ? 0 : op == '-' ? 1 : op == '*' ? 2 : 3;
+                write_varint(payload, zigzag(num) << 2 | code);
+            }
+            write_varint(out, payload.size());
+            out.append(payload);
+        }
+        return out;
+    }
+
+    static std::vector<long> decode_results(std::string_view data) {
+        std::vector<long> results;
+        std::uint64_t value = 0;
+        unsigned shift = 0;
+        for (char const c: data) {
+            auto const byte = static_cast<unsigned char>(c);
+            value |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+            shift += 7;
+            if (!(byte & 0x80) || shift >= 64) {
+                results.push_back(static_cast<long>(value >> 1) ^ -static_cast<long>(value & 1));
+                value = 0;
+                shift = 0;
+            }
+        }
+        return results;
+    }
+};
+
+#endif //BINARYPROTOCOL_H
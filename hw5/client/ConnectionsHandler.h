@@ -2,45 +2,94 @@
 #define CONNECTIONSHANDLER_H
 
 #include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <functional>
 #include <optional>
 
 #include <fcntl.h>
+#include <linux/errqueue.h>
 #include <netinet/in.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <unistd.h>
-#include <arpa/inet.h>
 
+#include "ServerAddress.h"
 #include "utility/random_int.h"
 
 
 class ConnectionsHandler {
 public:
+    // A request and its expected results, pointing into a Corpus
     struct Context {
-        std::string expressions;
+        // The text form, shown when a check fails
+        std::string_view expressions;
+        // What goes on the wire
+        std::string_view payload;
+        std::int64_t const *expected;
+        std::size_t expected_count;
+        bool binary;
     };
 
     struct Connection {
         int fd;
-        std::string sent;
+        // Bytes of the payload already written
+        std::size_t sent;
         std::string received;
         bool done;
+        // SO_ZEROCOPY is enabled on the socket
+        bool zerocopy;
         Context ctx;
     };
 
     using ReceiveCallback = std::function<void(Context const &, std::string)>;
+    // Yields the request of the next connection, nothing once all have been handed out
+    using ContextSource = std::function<std::optional<Context>()>;
+
+    // How a request is cut into send() calls
+    enum class Fragmentation {
+        // Random sizes, so the server has to reassemble requests split anywhere
+        Random,
+        // Options::fragment_size bytes per call
+        Fixed,
+        // As much as the socket takes, which measures raw throughput
+        Whole
+    };
+
+    struct Options {
+        // Connections open at the same time, new ones are opened as old ones finish; 0 is unlimited
+        std::size_t max_in_flight = 0;
+        // New connections per second; 0 is unlimited
+        double connect_rate = 0;
+        Fragmentation fragmentation = Fragmentation::Random;
+        std::size_t fragment_size = 0;
+        // Sends fragments of at least ZEROCOPY_MIN bytes with MSG_ZEROCOPY over TCP
+        bool zerocopy = false;
+    };
+
+    // Below this, pinning the pages costs more than copying them
+    static constexpr std::size_t ZEROCOPY_MIN = 16384;
 
 private:
     static constexpr int MAX_EVENTS_C = 1000;
     static constexpr int BUF_SIZE_C = 1024;
 
-    std::string const server_addr;
-    int const server_port;
     int const n;
+    ServerAddress const server;
+    Options const options;
+    // Entries of closed connections stay until their fd is reused
     std::unordered_map<int, Connection> conns;
+    std::size_t bytes_sent = 0;
+    std::size_t bytes_received = 0;
+    std::size_t connections_opened = 0;
+    std::size_t connections_failed = 0;
+    std::size_t zerocopy_sends = 0;
+    std::size_t zerocopy_copied = 0;
 
     int const epoll_fd;
     epoll_event ev{}, events[MAX_EVENTS_C]{};
@@ -52,26 +101,60 @@ private:
     }
 
 public:
-    explicit ConnectionsHandler(std::string server_addr, int const server_port, int const n)
-        : server_addr(std::move(server_addr)), server_port(server_port), n(n), epoll_fd(epoll_create1(0)) {
+    // Reads the completion notifications of MSG_ZEROCOPY sends, whose pages stay pinned until
+    // then. The payloads live in the corpus and never change, so nothing waits for them.
+    void drain_zerocopy_notifications(int fd) {
+        while (true) {
+            char control[128];
+            msghdr msg{};
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            if (recvmsg(fd, &msg, MSG_ERRQUEUE) < 0) {
+                return;
+            }
+            for (cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != nullptr; cm = CMSG_NXTHDR(&msg, cm)) {
+                auto const *err = reinterpret_cast<sock_extended_err const *>(CMSG_DATA(cm));
+                if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                    continue;
+                }
+                // ee_info..ee_data is the range of completed sends
+                std::size_t const count = err->ee_data - err->ee_info + 1;
+                zerocopy_sends += count;
+                if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                    zerocopy_copied += count;
+                }
+            }
+        }
+    }
+
+    std::size_t next_fragment(std::size_t left) const {
+        switch (options.fragmentation) {
+            case Fragmentation::Fixed:
+                return std::min(left, options.fragment_size);
+            case Fragmentation::Whole:
+                return left;
+            case Fragmentation::Random:
+            default:
+                return random_int(1, static_cast<int>(left));
+        }
+    }
+
+public:
+    ConnectionsHandler(ServerAddress const &server, int const n, Options const &options)
+        : n(n), server(server), options(options), epoll_fd(epoll_create1(0)) {
     }
 
     bool create_new_connection(Context const &ctx) {
-        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        int sock = socket(server.family(), SOCK_STREAM, 0);
         if (sock < 0) {
             perror("socket");
             exit(1);
         }
         set_nonblocking_c(sock);
-        sockaddr_in serv_addr{
-            .sin_family = AF_INET,
-            .sin_port = htons(server_port),
-            .sin_addr = {.s_addr = inet_addr(server_addr.c_str())},
-            .sin_zero = {},
-        };
-
-        inet_pton(AF_INET, "127.0.0.1", &serv_addr.sin_addr);
-        int rc = connect(sock, reinterpret_cast<sockaddr *>(&serv_addr), sizeof(serv_addr));
+        int opt = 1;
+        bool const zerocopy = options.zerocopy && server.family() == AF_INET
+                              && setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &opt, sizeof(opt)) == 0;
+        int rc = connect(sock, server.get(), server.size());
         if (rc < 0 && errno != EINPROGRESS) {
             perror("connect failed");
             close(sock);
@@ -80,13 +163,14 @@ public:
 
         conns[sock] = {
             .fd = sock,
-            .sent = "",
+            .sent = 0,
             .received = "",
             .done = false,
+            .zerocopy = zerocopy,
             .ctx = ctx
         };
 
-        ev.events = EPOLLOUT;
+        ev.events = EPOLLOUT | EPOLLIN;
         ev.data.fd = sock;
         if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &ev) < 0) {
             perror("epoll_ctl");
@@ -120,8 +204,12 @@ public:
         return std::nullopt;
     }
 
-    void send_all(ReceiveCallback const &receive_callback) {
-        std::size_t remaining = conns.size();
+    // Opens a connection per context of the source within the limits, sends each its request and
+    // hands every complete reply to the callback
+    void send_all(ContextSource const &next_context, ReceiveCallback const &receive_callback) {
+        std::size_t remaining = 0;
+        bool exhausted = false;
+        auto const start = std::chrono::steady_clock::now();
 
         auto handle_shutdown = [&](Connection &connection, int fd) {
             connection.done = true;
@@ -130,8 +218,37 @@ public:
             close(fd);
         };
 
-        while (remaining > 0) {
-            int nf = epoll_wait(epoll_fd, events, MAX_EVENTS_C, -1);
+        // Opens what the limits allow; returns the epoll_wait timeout until the rate allows more
+        auto open_connections = [&]() -> int {
+            while (!exhausted && (options.max_in_flight == 0 || remaining < options.max_in_flight)) {
+                if (options.connect_rate > 0) {
+                    std::chrono::duration<double> const due(static_cast<double>(connections_opened) / options.connect_rate);
+                    std::chrono::duration<double> const elapsed = std::chrono::steady_clock::now() - start;
+                    if (elapsed < due) {
+                        return static_cast<int>(std::ceil((due - elapsed).count() * 1000));
+                    }
+                }
+                std::optional<Context> const ctx = next_context();
+                if (!ctx.has_value()) {
+                    exhausted = true;
+                    break;
+                }
+                ++connections_opened;
+                if (create_new_connection(*ctx)) {
+                    ++remaining;
+                } else {
+                    ++connections_failed;
+                }
+            }
+            return -1;
+        };
+
+        while (true) {
+            int const timeout = open_connections();
+            if (remaining == 0 && exhausted) {
+                break;
+            }
+            int nf = epoll_wait(epoll_fd, events, MAX_EVENTS_C, timeout);
             // std::cout << "epoll_wait returned nf=" << nf << std::endl;
             if (nf < 0) {
                 perror("epoll_wait");
@@ -144,21 +261,32 @@ public:
                     continue;
                 }
                 Connection &c = conns[fd];
+                if (!c.done && c.zerocopy && (events[i].events & EPOLLERR)) {
+                    drain_zerocopy_notifications(fd);
+                }
 
                 if (!c.done && (events[i].events & EPOLLOUT)) {
-                    if (c.sent.size() < c.ctx.expressions.size()) {
-                        std::size_t left = c.ctx.expressions.size() - c.sent.size();
-                        std::size_t frag = random_int(1, static_cast<int>(left));
-                        std::string part = c.ctx.expressions.substr(c.sent.size(), frag);
-                        long sent_bytes = send(fd, part.c_str(), part.size(), 0);
+                    std::string_view const payload = c.ctx.payload;
+                    if (c.sent < payload.size()) {
+                        std::size_t frag = next_fragment(payload.size() - c.sent);
+                        int const flags = c.zerocopy && frag >= ZEROCOPY_MIN ? MSG_ZEROCOPY : 0;
+                        long sent_bytes = send(fd, payload.data() + c.sent, frag, flags);
+                        if (sent_bytes < 0 && errno == ENOBUFS && flags != 0) {
+                            // Out of optmem for pinned pages, this fragment is copied instead
+                            sent_bytes = send(fd, payload.data() + c.sent, frag, 0);
+                        }
+                        if (sent_bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                            continue;
+                        }
                         if (sent_bytes < 0) {
                             perror("send");
                             handle_shutdown(c, fd);
                             continue;
                         }
-                        c.sent.append(part.substr(0, sent_bytes));
+                        c.sent += sent_bytes;
+                        bytes_sent += sent_bytes;
                     }
-                    if (c.sent.size() == c.ctx.expressions.size()) {
+                    if (c.sent == payload.size()) {
                         ev.events = EPOLLIN;
                         ev.data.fd = fd;
                         if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) < 0) {
@@ -170,12 +298,39 @@ public:
                     auto data = read_all_data(fd, c, handle_shutdown);
 
                     if (data.has_value()) {
+                        bytes_received += data->size();
                         receive_callback(c.ctx, data.value());
                     }
                 }
             }
         }
     }
+
+    std::size_t get_bytes_sent() const {
+        return bytes_sent;
+    }
+
+    std::size_t get_bytes_received() const {
+        return bytes_received;
+    }
+
+    std::size_t get_connections_opened() const {
+        return connections_opened;
+    }
+
+    std::size_t get_connections_failed() const {
+        return connections_failed;
+    }
+
+    // MSG_ZEROCOPY sends reported complete before their connection closed, and how many of them
+    // the kernel copied after all
+    std::size_t get_zerocopy_sends() const {
+        return zerocopy_sends;
+    }
+
+    std::size_t get_zerocopy_copied() const {
+        return zerocopy_copied;
+    }
 };
 
 #endif //CONNECTIONSHANDLER_H
@@ -0,0 +1,237 @@
+#ifndef CORPUS_H
+#define CORPUS_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "BinaryProtocol.h"
+#include "ExprGenerator.h"
+
+
+// Requests with their expected results, generated once and then only read. The same layout is
+// built in memory for a run or written to a file by the corpus tool and mapped by the client,
+// which sends straight from it and verifies replies against the stored results:
+//   Header
+//   u64 result_begin[requests + 1], u64 text_begin[requests + 1], u64 binary_begin[requests + 1]
+//   i64 results[results]
+//   text: the expressions of every request, each followed by a space
+//   binary: every request in the binary protocol, MAGIC included
+class Corpus {
+public:
+    struct Header {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t n;
+        std::uint64_t seed;
+        std::uint64_t requests;
+        std::uint64_t results;
+        std::uint64_t text_size;
+        std::uint64_t binary_size;
+    };
+
+    static constexpr char MAGIC[8] = {'H', 'W', '5', 'C', 'O', 'R', 'P', 'S'};
+    static constexpr std::uint32_t VERSION = 1;
+
+private:
+    // Either owns the bytes or points into a mapping
+    std::string storage;
+    char const *data = nullptr;
+    std::size_t length = 0;
+    bool mapped = false;
+
+    Header header{};
+    std::uint64_t const *result_begin = nullptr;
+    std::uint64_t const *text_begin = nullptr;
+    std::uint64_t const *binary_begin = nullptr;
+    std::int64_t const *results = nullptr;
+    char const *text_data = nullptr;
+    char const *binary_data = nullptr;
+
+    static std::size_t layout_size(Header const &h) {
+        return sizeof(Header) + 3 * (h.requests + 1) * sizeof(std::uint64_t) + h.results * sizeof(std::int64_t)
+               + h.text_size + h.binary_size;
+    }
+
+    static void append(std::string &out, void const *bytes, std::size_t size) {
+        out.append(static_cast<char const *>(bytes), size);
+    }
+
+    // Checks the header and the offsets against the size, so a truncated or foreign file is
+    // rejected instead of read out of bounds
+    bool attach() {
+        if (length < sizeof(Header)) {
+            return false;
+        }
+        std::memcpy(&header, data, sizeof(Header));
+        if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != VERSION
+            || header.requests == 0 || header.requests > length || header.results > length
+            || header.text_size > length || header.binary_size > length || layout_size(header) != length) {
+            return false;
+        }
+        auto const *offsets = reinterpret_cast<std::uint64_t const *>(data + sizeof(Header));
+        result_begin = offsets;
+        text_begin = offsets + header.requests + 1;
+        binary_begin = text_begin + header.requests + 1;
+        results = reinterpret_cast<std::int64_t const *>(binary_begin + header.requests + 1);
+        text_data = reinterpret_cast<char const *>(results + header.results);
+        binary_data = text_data + header.text_size;
+        for (std::uint64_t i = 0; i < header.requests; ++i) {
+            if (result_begin[i] > result_begin[i + 1] || text_begin[i] > text_begin[i + 1]
+                || binary_begin[i] > binary_begin[i + 1]) {
+                return false;
+            }
+        }
+        return result_begin[header.requests] == header.results && text_begin[header.requests] == header.text_size
+               && binary_begin[header.requests] == header.binary_size;
+    }
+
+    void unmap() {
+        if (mapped) {
+            munmap(const_cast<char *>(data), length);
+            mapped = false;
+        }
+        data = nullptr;
+        length = 0;
+    }
+
+public:
+    Corpus() = default;
+
+    Corpus(Corpus const &) = delete;
+
+    Corpus &operator=(Corpus const &) = delete;
+
+    ~Corpus() {
+        unmap();
+    }
+
+    // Requests of min_expr_in_req..max_expr_in_req expressions of n operands each, reproducible
+    // from the seed; the generator's mt19937 takes 32 bits of it
+    static std::string generate(std::uint64_t requests, int n, int min_expr_in_req, int max_expr_in_req,
+                                std::uint32_t seed) {
+        // mt19937 turns the int back into the same 32 bits, so every seed gives its own corpus
+        ExprGenerator generator(static_cast<int>(seed));
+        std::string text, binary;
+        std::string result_bytes, result_offsets, text_offsets, binary_offsets;
+        std::uint64_t result_count = 0;
+        for (std::uint64_t i = 0; i < requests; ++i) {
+            append(result_offsets, &result_count, sizeof(result_count));
+            std::uint64_t offset = text.size();
+            append(text_offsets, &offset, sizeof(offset));
+            offset = binary.size();
+            append(binary_offsets, &offset, sizeof(offset));
+
+            std::size_t const start = text.size();
+            int const expr_cnt = generator.gen_count(min_expr_in_req, max_expr_in_req);
+            for (int j = 0; j < expr_cnt; ++j) {
+                std::string const expression = generator.gen_expr(n);
+                std::int64_t const result = ExprGenerator::evaluate_check(expression);
+                append(result_bytes, &result, sizeof(result));
+                ++result_count;
+                text += expression;
+                text += ' ';
+            }
+            binary += BinaryProtocol::encode(text.substr(start));
+        }
+        append(result_offsets, &result_count, sizeof(result_count));
+        std::uint64_t offset = text.size();
+        append(text_offsets, &offset, sizeof(offset));
+        offset = binary.size();
+        append(binary_offsets, &offset, sizeof(offset));
+
+        Header h{};
+        std::memcpy(h.magic, MAGIC, sizeof(MAGIC));
+        h.version = VERSION;
+        h.n = static_cast<std::uint32_t>(n);
+        h.seed = seed;
+        h.requests = requests;
+        h.results = result_count;
+        h.text_size = text.size();
+        h.binary_size = binary.size();
+
+        std::string out;
+        out.reserve(layout_size(h));
+        append(out, &h, sizeof(h));
+        out += result_offsets;
+        out += text_offsets;
+        out += binary_offsets;
+        out += result_bytes;
+        out += text;
+        out += binary;
+        return out;
+    }
+
+    // Takes a corpus built by generate()
+    bool load(std::string bytes) {
+        unmap();
+        storage = std::move(bytes);
+        data = storage.data();
+        length = storage.size();
+        return attach();
+    }
+
+    // Maps a corpus file read-only, so it costs nothing until pages are touched
+    bool open(std::string const &path) {
+        unmap();
+        int const fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            perror("open");
+            return false;
+        }
+        struct stat st{};
+        if (fstat(fd, &st) < 0 || st.st_size == 0) {
+            close(fd);
+            return false;
+        }
+        void *mapping = mmap(nullptr, static_cast<std::size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED) {
+            perror("mmap");
+            return false;
+        }
+        data = static_cast<char const *>(mapping);
+        length = static_cast<std::size_t>(st.st_size);
+        mapped = true;
+        return attach();
+    }
+
+    std::size_t size() const {
+        return header.requests;
+    }
+
+    std::uint64_t seed() const {
+        return header.seed;
+    }
+
+    // Expressions of request i, each followed by a space
+    std::string_view text(std::size_t i) const {
+        return {text_data + text_begin[i], text_begin[i + 1] - text_begin[i]};
+    }
+
+    // Request i in the binary protocol, starting with MAGIC
+    std::string_view binary(std::size_t i) const {
+        return {binary_data + binary_begin[i], binary_begin[i + 1] - binary_begin[i]};
+    }
+
+    std::int64_t const *expected(std::size_t i) const {
+        return results + result_begin[i];
+    }
+
+    std::size_t expected_count(std::size_t i) const {
+        return result_begin[i + 1] - result_begin[i];
+    }
+
+    std::size_t expression_count() const {
+        return header.results;
+    }
+};
+
+#endif //CORPUS_H
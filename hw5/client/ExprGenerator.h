@@ -52,6 +52,11 @@ public:
         return result;
     }
 
+    // Number of expressions in a request, min..max
+    int gen_count(int min, int max) {
+        return std::uniform_int_distribution<>(min, max)(gen);
+    }
+
     std::string gen_expr(int n) {
         std::uniform_int_distribution<> num_dist(1, 100);
         std::uniform_int_distribution<> op_dist(0, 3);
@@ -0,0 +1,83 @@
+#ifndef LATENCYHISTOGRAM_H
+#define LATENCYHISTOGRAM_H
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+
+
+// HDR-style log-linear histogram of non-negative values (nanoseconds for latencies). Values
+// below 128 are counted exactly, every larger power-of-two range is split into 64 buckets,
+// so a reported value is never more than 1/64 above the recorded one. Recording is a few
+// instructions and nothing is allocated, so it can sit on the hot path of a load generator.
+class LatencyHistogram {
+    static constexpr unsigned SUB_BITS = 7;
+    static constexpr std::uint64_t SUB_COUNT = 1ull << SUB_BITS;
+    static constexpr std::uint64_t HALF_COUNT = SUB_COUNT / 2;
+    static constexpr std::size_t BUCKETS = SUB_COUNT + (64 - SUB_BITS) * HALF_COUNT;
+
+    std::array<std::uint64_t, BUCKETS> counts{};
+    std::uint64_t total = 0;
+    std::uint64_t largest = 0;
+
+    static std::size_t index_of(std::uint64_t value) {
+        if (value < SUB_COUNT) {
+            return value;
+        }
+        unsigned const shift = 64 - __builtin_clzll(value) - SUB_BITS;
+        return SUB_COUNT + (shift - 1) * HALF_COUNT + ((value >> shift) - HALF_COUNT);
+    }
+
+    // The largest value that falls into the bucket
+    static std::uint64_t highest_of(std::size_t index) {
+        if (index < SUB_COUNT) {
+            return index;
+        }
+        std::size_t const k = index - SUB_COUNT;
+        unsigned const shift = k / HALF_COUNT + 1;
+        std::uint64_t const top = k % HALF_COUNT + HALF_COUNT;
+        return ((top + 1) << shift) - 1;
+    }
+
+public:
+    void record(std::uint64_t value) {
+        ++counts[index_of(value)];
+        ++total;
+        largest = std::max(largest, value);
+    }
+
+    void merge(LatencyHistogram const &other) {
+        for (std::size_t i = 0; i < BUCKETS; ++i) {
+            counts[i] += other.counts[i];
+        }
+        total += other.total;
+        largest = std::max(largest, other.largest);
+    }
+
+    // Value at or below which the given percentage (0..100) of the recorded values lie
+    std::uint64_t percentile(double percent) const {
+        if (total == 0) {
+            return 0;
+        }
+        auto const rank = static_cast<std::uint64_t>(percent / 100.0 * static_cast<double>(total) + 0.5);
+        std::uint64_t const target = std::clamp<std::uint64_t>(rank, 1, total);
+        std::uint64_t seen = 0;
+        for (std::size_t i = 0; i < BUCKETS; ++i) {
+            seen += counts[i];
+            if (seen >= target) {
+                return std::min(highest_of(i), largest);
+            }
+        }
+        return largest;
+    }
+
+    std::uint64_t max() const {
+        return largest;
+    }
+
+    std::uint64_t count() const {
+        return total;
+    }
+};
+
+#endif //LATENCYHISTOGRAM_H
@@ -0,0 +1,398 @@
+#ifndef LOADRUNNER_H
+#define LOADRUNNER_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "BinaryProtocol.h"
+#include "LatencyHistogram.h"
+#include "ServerAddress.h"
+
+
+// Load generator over persistent connections. In the open loop request i is due at
+// start + i / rate whatever happened to the earlier ones, and goes to the connections in turn.
+// Its latency is measured from that intended time, not from when it was actually written, so a
+// server stall shows up in the latency of every request scheduled during it instead of silently
+// lowering the offered load (coordinated omission). Requests are written as soon as they are
+// due, a connection the server does not read from keeps them in its own buffer. In the closed
+// loop every connection sends its next request as soon as the previous one is answered, which
+// measures the throughput a given concurrency reaches.
+class LoadRunner {
+public:
+    struct Request {
+        // Expressions each followed by a space, or their binary frames without MAGIC
+        std::string_view payload;
+        std::int64_t const *expected;
+        std::size_t expected_count;
+    };
+
+    struct Report {
+        std::uint64_t issued = 0;
+        std::uint64_t completed = 0;
+        // Answers received, one per expression
+        std::uint64_t expressions = 0;
+        std::uint64_t mismatches = 0;
+        // Requests lost with a connection the server closed, or never answered
+        std::uint64_t failed = 0;
+        double elapsed_s = 0;
+        LatencyHistogram latency;
+
+        // Combines the reports of runners working side by side
+        void merge(Report const &other) {
+            issued += other.issued;
+            completed += other.completed;
+            expressions += other.expressions;
+            mismatches += other.mismatches;
+            failed += other.failed;
+            elapsed_s = std::max(elapsed_s, other.elapsed_s);
+            latency.merge(other.latency);
+        }
+    };
+
+private:
+    static constexpr int MAX_EVENTS_C = 256;
+    static constexpr int BUF_SIZE_C = 16384;
+    static constexpr std::uint32_t TIMER_KEY = UINT32_MAX;
+    // How long answers are awaited after the last request is due
+    static constexpr std::uint64_t DRAIN_NS = 5'000'000'000;
+
+    struct InFlight {
+        std::uint64_t intended_ns;
+        Request const *request;
+        std::size_t answered;
+    };
+
+    struct Connection {
+        int fd = -1;
+        std::string output;
+        std::size_t output_sent = 0;
+        std::deque<InFlight> in_flight;
+        // The text result or varint being received
+        std::string token;
+        std::uint64_t varint = 0;
+        unsigned shift = 0;
+        bool waiting_writable = false;
+        bool dirty = false;
+    };
+
+    ServerAddress const server;
+    bool const binary;
+    std::vector<Connection> conns;
+    std::vector<std::size_t> dirty;
+    Report report;
+
+    int const epoll_fd;
+    int const timer_fd;
+    epoll_event ev{}, events[MAX_EVENTS_C]{};
+
+    static std::uint64_t now_ns() {
+        timespec ts{};
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return static_cast<std::uint64_t>(ts.tv_sec) * 1'000'000'000 + static_cast<std::uint64_t>(ts.tv_nsec);
+    }
+
+    void arm_timer(std::uint64_t at_ns) {
+        itimerspec spec{};
+        spec.it_value.tv_sec = static_cast<time_t>(at_ns / 1'000'000'000);
+        spec.it_value.tv_nsec = static_cast<long>(at_ns % 1'000'000'000);
+        timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, nullptr);
+    }
+
+    void watch(std::size_t i, std::uint32_t events_mask) {
+        ev.events = events_mask;
+        ev.data.u32 = static_cast<std::uint32_t>(i);
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conns[i].fd, &ev) < 0) {
+            perror("epoll_ctl");
+        }
+    }
+
+    void drop(Connection &c) {
+        report.failed += c.in_flight.size();
+        c.in_flight.clear();
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c.fd, nullptr);
+        close(c.fd);
+        c.fd = -1;
+    }
+
+    void complete(Connection &c, long result, bool valid, std::uint64_t now) {
+        if (c.in_flight.empty()) {
+            ++report.mismatches;
+            return;
+        }
+        InFlight &request = c.in_flight.front();
+        ++report.expressions;
+        if (!valid || result != request.request->expected[request.answered]) {
+            ++report.mismatches;
+        }
+        if (++request.answered < request.request->expected_count) {
+            return;
+        }
+        ++report.completed;
+        report.latency.record(now > request.intended_ns ? now - request.intended_ns : 0);
+        c.in_flight.pop_front();
+    }
+
+    void parse(Connection &c, char const *data, std::size_t size, std::uint64_t now) {
+        for (std::size_t i = 0; i < size; ++i) {
+            char const ch = data[i];
+            if (binary) {
+                auto const byte = static_cast<unsigned char>(ch);
+                c.varint |= static_cast<std::uint64_t>(byte & 0x7f) << c.shift;
+                c.shift += 7;
+                if (!(byte & 0x80) || c.shift >= 64) {
+                    complete(c, static_cast<long>(c.varint >> 1) ^ -static_cast<long>(c.varint & 1), true, now);
+                    c.varint = 0;
+                    c.shift = 0;
+                }
+            } else if (ch == ' ' || ch == '\n' || ch == '\t' || ch == '\r') {
+                if (!c.token.empty()) {
+                    char *end = nullptr;
+                    errno = 0;
+                    long const result = std::strtol(c.token.c_str(), &end, 10);
+                    complete(c, result, errno == 0 && *end == '\0', now);
+                    c.token.clear();
+                }
+            } else {
+                c.token.push_back(ch);
+            }
+        }
+    }
+
+    void receive(Connection &c) {
+        char buf[BUF_SIZE_C];
+        while (c.fd >= 0) {
+            long const len = recv(c.fd, buf, sizeof(buf), 0);
+            if (len > 0) {
+                parse(c, buf, static_cast<std::size_t>(len), now_ns());
+                continue;
+            }
+            if (len < 0 && errno == EINTR) continue;
+            if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return;
+            }
+            if (len < 0) {
+                perror("recv");
+            }
+            drop(c);
+        }
+    }
+
+    void flush(std::size_t i) {
+        Connection &c = conns[i];
+        while (c.fd >= 0 && c.output_sent < c.output.size()) {
+            long const sent = send(c.fd, c.output.data() + c.output_sent, c.output.size() - c.output_sent,
+                                   MSG_NOSIGNAL);
+            if (sent > 0) {
+                c.output_sent += static_cast<std::size_t>(sent);
+                continue;
+            }
+            if (sent < 0 && errno == EINTR) continue;
+            if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                if (!c.waiting_writable) {
+                    c.waiting_writable = true;
+                    watch(i, EPOLLIN | EPOLLOUT);
+                }
+                return;
+            }
+            perror("send");
+            drop(c);
+            return;
+        }
+        if (c.fd < 0) {
+            return;
+        }
+        c.output.clear();
+        c.output_sent = 0;
+        if (c.waiting_writable) {
+            c.waiting_writable = false;
+            watch(i, EPOLLIN);
+        }
+    }
+
+    // Queues request index of the cycle on connection i
+    void issue(std::size_t i, std::uint64_t index, std::uint64_t intended_ns, std::vector<Request> const &requests) {
+        ++report.issued;
+        Connection &c = conns[i];
+        if (c.fd < 0) {
+            ++report.failed;
+            return;
+        }
+        Request const &request = requests[index % requests.size()];
+        c.output.append(request.payload);
+        c.in_flight.push_back({intended_ns, &request, 0});
+        if (!c.dirty) {
+            c.dirty = true;
+            dirty.push_back(i);
+        }
+    }
+
+public:
+    LoadRunner(ServerAddress const &server, bool binary)
+        : server(server), binary(binary), epoll_fd(epoll_create1(0)),
+          timer_fd(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) {
+        ev.events = EPOLLIN;
+        ev.data.u32 = TIMER_KEY;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev);
+    }
+
+    ~LoadRunner() {
+        for (Connection const &c: conns) {
+            if (c.fd >= 0) {
+                close(c.fd);
+            }
+        }
+        close(timer_fd);
+        close(epoll_fd);
+    }
+
+    LoadRunner(LoadRunner const &) = delete;
+
+    LoadRunner &operator=(LoadRunner const &) = delete;
+
+    // Connects before the measurement starts, so connection setup is not part of any latency
+    bool create_new_connection() {
+        int const sock = socket(server.family(), SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (sock < 0) {
+            perror("socket");
+            return false;
+        }
+        if (connect(sock, server.get(), server.size()) < 0) {
+            perror("connect failed");
+            close(sock);
+            return false;
+        }
+        if (server.family() == AF_INET) {
+            int opt = 1;
+            setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+        }
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+
+        ev.events = EPOLLIN;
+        ev.data.u32 = static_cast<std::uint32_t>(conns.size());
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+            perror("epoll_ctl");
+            close(sock);
+            return false;
+        }
+        Connection &c = conns.emplace_back();
+        c.fd = sock;
+        if (binary) {
+            c.output.push_back(static_cast<char>(BinaryProtocol::MAGIC));
+        }
+        return true;
+    }
+
+    // Issues rate * duration_s requests cycling through the given ones, or runs the closed loop
+    // for duration_s when rate is not positive, then waits for the answers still in flight.
+    // A request completes with the answer to its last expression.
+    Report run(std::vector<Request> const &requests, double rate, double duration_s) {
+        report = {};
+        if (conns.empty() || requests.empty()) {
+            return report;
+        }
+        bool const closed = rate <= 0;
+        auto const total = closed ? UINT64_MAX : static_cast<std::uint64_t>(rate * duration_s);
+        double const interval_ns = closed ? 0 : 1e9 / rate;
+        std::uint64_t const start = now_ns();
+        std::uint64_t const schedule_end = start + static_cast<std::uint64_t>(duration_s * 1e9);
+        std::uint64_t next = 0;
+        std::uint64_t last_answer = start;
+
+        auto outstanding = [&] {
+            for (Connection const &c: conns) {
+                if (!c.in_flight.empty()) return true;
+            }
+            return false;
+        };
+
+        if (closed) {
+            for (std::size_t i = 0; i < conns.size(); ++i) {
+                issue(i, next++, start, requests);
+            }
+        }
+        while (true) {
+            std::uint64_t const now = now_ns();
+            while (!closed && next < total) {
+                std::uint64_t const intended = start + static_cast<std::uint64_t>(static_cast<double>(next) * interval_ns);
+                if (intended > now) {
+                    arm_timer(intended);
+                    break;
+                }
+                issue(next % conns.size(), next, intended, requests);
+                ++next;
+            }
+            for (std::size_t const i: dirty) {
+                conns[i].dirty = false;
+                flush(i);
+            }
+            dirty.clear();
+
+            if (closed ? now >= schedule_end : next == total) {
+                if (!outstanding() || now >= schedule_end + DRAIN_NS) {
+                    break;
+                }
+                arm_timer(schedule_end + DRAIN_NS);
+            } else if (closed) {
+                arm_timer(schedule_end);
+            }
+
+            int const nf = epoll_wait(epoll_fd, events, MAX_EVENTS_C, -1);
+            if (nf < 0) {
+                if (errno != EINTR) perror("epoll_wait");
+                continue;
+            }
+            for (int e = 0; e < nf; ++e) {
+                std::uint32_t const key = events[e].data.u32;
+                if (key == TIMER_KEY) {
+                    std::uint64_t expirations;
+                    if (read(timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+                        perror("read");
+                    }
+                    continue;
+                }
+                Connection &c = conns[key];
+                if (c.fd < 0) {
+                    continue;
+                }
+                if (events[e].events & EPOLLOUT) {
+                    flush(key);
+                }
+                if (events[e].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                    std::uint64_t const completed = report.completed;
+                    receive(c);
+                    if (report.completed != completed) {
+                        last_answer = now_ns();
+                        if (closed && c.fd >= 0 && c.in_flight.empty() && last_answer < schedule_end) {
+                            issue(key, next++, last_answer, requests);
+                        }
+                    }
+                }
+            }
+        }
+
+        for (Connection &c: conns) {
+            report.failed += c.in_flight.size();
+            c.in_flight.clear();
+        }
+        report.elapsed_s = static_cast<double>(std::max(last_answer, schedule_end) - start) / 1e9;
+        return report;
+    }
+};
+
+#endif //LOADRUNNER_H
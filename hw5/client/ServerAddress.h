@@ -0,0 +1,63 @@
+#ifndef SERVERADDRESS_H
+#define SERVERADDRESS_H
+
+#include <string>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+
+
+// Where the client connects: "unix:<path>" for a server on an AF_UNIX socket, an IPv4 address
+// and port otherwise. Built once and shared by every connection.
+class ServerAddress {
+    sockaddr_storage storage{};
+    socklen_t length = 0;
+
+public:
+    static constexpr char UNIX_PREFIX[] = "unix:";
+
+    static bool is_unix(std::string const &server_addr) {
+        return server_addr.rfind(UNIX_PREFIX, 0) == 0;
+    }
+
+    static bool valid(std::string const &server_addr) {
+        if (is_unix(server_addr)) {
+            std::size_t const path_len = server_addr.size() - (sizeof(UNIX_PREFIX) - 1);
+            return path_len > 0 && path_len < sizeof(sockaddr_un::sun_path);
+        }
+        in_addr addr{};
+        return inet_pton(AF_INET, server_addr.c_str(), &addr) == 1;
+    }
+
+    // server_addr must be valid(); the port is ignored for AF_UNIX
+    ServerAddress(std::string const &server_addr, int server_port) {
+        if (is_unix(server_addr)) {
+            auto &addr = reinterpret_cast<sockaddr_un &>(storage);
+            addr.sun_family = AF_UNIX;
+            server_addr.copy(addr.sun_path, sizeof(addr.sun_path) - 1, sizeof(UNIX_PREFIX) - 1);
+            length = sizeof(addr);
+        } else {
+            auto &addr = reinterpret_cast<sockaddr_in &>(storage);
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(server_port);
+            inet_pton(AF_INET, server_addr.c_str(), &addr.sin_addr);
+            length = sizeof(addr);
+        }
+    }
+
+    int family() const {
+        return storage.ss_family;
+    }
+
+    sockaddr const *get() const {
+        return reinterpret_cast<sockaddr const *>(&storage);
+    }
+
+    socklen_t size() const {
+        return length;
+    }
+};
+
+#endif //SERVERADDRESS_H
@@ -8,14 +8,26 @@ SET(CMAKE_CXX_EXTENSIONS OFF)
 
 SET(SOURCE_FILES
         client/main.cpp
+        client/BinaryProtocol.h
         client/ExprGenerator.h
         client/ConnectionsHandler.h
+        client/Corpus.h
+        client/LatencyHistogram.h
+        client/LoadRunner.h
+        client/ServerAddress.h
 )
 
 add_executable(client ${SOURCE_FILES})
 
+find_package(Threads REQUIRED)
+target_link_libraries(client PRIVATE Threads::Threads)
+
+add_executable(corpus client/corpus.cpp client/Corpus.h client/BinaryProtocol.h client/ExprGenerator.h)
+
 if (CMAKE_BUILD_TYPE MATCHES Debug)
     target_compile_options(client PRIVATE -g -O0 -Wall -Wextra -Werror)
+    target_compile_options(corpus PRIVATE -g -O0 -Wall -Wextra -Werror)
 elseif (CMAKE_BUILD_TYPE MATCHES Release)
     target_compile_options(client PRIVATE -O3 -DNDEBUG)
+    target_compile_options(corpus PRIVATE -O3 -DNDEBUG)
 endif ()
\ No newline at end of file
@@ -0,0 +1,46 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include "Corpus.h"
+
+
+// Writes a workload corpus for `client --corpus`: the requests and their expected results,
+// generated once from a fixed seed so every run sends and checks exactly the same data.
+// Usage: corpus <file> <requests> <n> <max_expr_in_req> [--seed <s>]
+int main(int argc, char *argv[]) {
+    if (argc != 5 && !(argc == 7 && std::string(argv[5]) == "--seed")) {
+        std::cerr << "Usage: " << argv[0] << " <file> <requests> <n> <max_expr_in_req> [--seed <s>]" << '\n';
+        return EXIT_FAILURE;
+    }
+    std::string const path = argv[1];
+    long const requests = std::atol(argv[2]);
+    int const n = std::atoi(argv[3]);
+    int const max_expr_in_req = std::atoi(argv[4]);
+    char *seed_end = nullptr;
+    unsigned long long const seed = argc == 7 ? std::strtoull(argv[6], &seed_end, 10) : 42;
+    if (requests <= 0 || n <= 0 || max_expr_in_req <= 0) {
+        std::cerr << "Invalid arguments" << '\n';
+        return EXIT_FAILURE;
+    }
+    if ((seed_end != nullptr && *seed_end != '\0') || seed > UINT32_MAX) {
+        std::cerr << "The seed must be a number from 0 to " << UINT32_MAX << '\n';
+        return EXIT_FAILURE;
+    }
+
+    std::string const corpus = Corpus::generate(requests, n, 1, max_expr_in_req, static_cast<std::uint32_t>(seed));
+    FILE *file = std::fopen(path.c_str(), "wb");
+    if (file == nullptr) {
+        perror("fopen");
+        return EXIT_FAILURE;
+    }
+    bool const written = std::fwrite(corpus.data(), 1, corpus.size(), file) == corpus.size();
+    if (std::fclose(file) != 0 || !written) {
+        perror("write");
+        return EXIT_FAILURE;
+    }
+    std::cout << "Wrote " << requests << " requests, " << corpus.size() << " bytes to " << path << std::endl;
+    return EXIT_SUCCESS;
+}
@@ -1,10 +1,18 @@
 #include <string>
 #include <optional>
 #include <iostream>
+#include <fstream>
+#include <memory>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <vector>
 
-#include "ExprGenerator.h"
+#include "BinaryProtocol.h"
 #include "ConnectionsHandler.h"
-#include "utility/random_int.h"
+#include "Corpus.h"
+#include "LoadRunner.h"
+#include "ServerAddress.h"
 
 struct CommandLineArgs {
     int const n;
@@ -12,54 +20,327 @@ struct CommandLineArgs {
     std::string const server_addr;
     int const server_port;
     int const max_expr_in_req;
+    bool const binary;
+    // Open-loop mode when positive: requests per second over all connections
+    double const rate;
+    double const duration_s;
+    // Connections are sharded across this many threads, each with its own epoll loop
+    int const threads;
+    // Requests come from this corpus file instead of being generated, n and max_expr_in_req
+    // are ignored then
+    std::string const corpus_path;
+    // Closed-loop mode: connections open at once and new connections per second, 0 is unlimited
+    int const max_in_flight;
+    double const connect_rate;
+    // How requests are cut into send() calls: random, whole, or a fixed number of bytes
+    ConnectionsHandler::Fragmentation const fragmentation;
+    std::size_t const fragment_size;
+    bool const zerocopy;
+    // Sweep mode when not empty: CSV to write, and the concurrency levels and exact batch sizes
+    // to step through
+    std::string const sweep_path;
+    std::vector<int> const sweep_connections;
+    std::vector<int> const sweep_batches;
 };
 
+// "1,2,4" -> {1, 2, 4}; an unparsable item becomes 0 and is rejected by the caller
+std::vector<int> parse_list(std::string const &list) {
+    std::vector<int> values;
+    std::size_t begin = 0;
+    while (begin <= list.size()) {
+        std::size_t end = list.find(',', begin);
+        if (end == std::string::npos) end = list.size();
+        values.push_back(std::atoi(list.substr(begin, end - begin).c_str()));
+        begin = end + 1;
+    }
+    return values;
+}
+
 std::pair<CommandLineArgs, std::optional<std::string>> parse_cla(int argc, char *argv[]) {
-    if (argc < 5 || argc > 6) {
-        return {{}, ("Usage: " + std::string(argv[0]) + " <n> <connections> <server_addr> <server_port> <max_expr_in_req>")};
+    int positional = 1;
+    while (positional < argc && std::string(argv[positional]).rfind("--", 0) != 0) {
+        ++positional;
+    }
+    if (positional < 5 || positional > 6) {
+        return {{}, ("Usage: " + std::string(argv[0]) +
+                     " <n> <connections> <server_addr|unix:path> <server_port> <max_expr_in_req> [--binary]"
+                     " [--rate <req/s> [--duration-s <s>]] [--threads <n>]"
+                     " [--corpus <file>] [--max-in-flight <n>] [--connect-rate <conn/s>]"
+                     " [--fragment random|whole|<bytes>] [--zerocopy]"
+                     " [--sweep <csv> [--sweep-connections <n,...>] [--sweep-batches <n,...>]]")};
     }
 
     int n = std::atoi(argv[1]);
     int connections = std::atoi(argv[2]);
     std::string server_addr = argv[3];
     int server_port = std::atoi(argv[4]);
-    int max_expr_in_req = argc == 6 ? std::atoi(argv[5]) : 1;
+    int max_expr_in_req = positional == 6 ? std::atoi(argv[5]) : 1;
+    bool binary = false;
+    double rate = 0;
+    double duration_s = 10;
+    bool rate_set = false;
+    int threads = 1;
+    std::string corpus_path;
+    int max_in_flight = 0;
+    double connect_rate = 0;
+    auto fragmentation = ConnectionsHandler::Fragmentation::Random;
+    long fragment_size = 0;
+    bool zerocopy = false;
+    std::string sweep_path;
+    std::vector<int> sweep_connections, sweep_batches;
 
-    if (n <= 0 || connections <= 0 || server_port <= 0 || max_expr_in_req <= 0) {
+    for (int i = positional; i < argc; ++i) {
+        std::string const option = argv[i];
+        if (option == "--binary") {
+            binary = true;
+        } else if (option == "--rate" && i + 1 < argc) {
+            rate = std::atof(argv[++i]);
+            rate_set = true;
+        } else if (option == "--duration-s" && i + 1 < argc) {
+            duration_s = std::atof(argv[++i]);
+        } else if (option == "--threads" && i + 1 < argc) {
+            threads = std::atoi(argv[++i]);
+        } else if (option == "--corpus" && i + 1 < argc) {
+            corpus_path = argv[++i];
+        } else if (option == "--max-in-flight" && i + 1 < argc) {
+            max_in_flight = std::atoi(argv[++i]);
+        } else if (option == "--connect-rate" && i + 1 < argc) {
+            connect_rate = std::atof(argv[++i]);
+        } else if (option == "--fragment" && i + 1 < argc) {
+            std::string const mode = argv[++i];
+            if (mode == "random") {
+                fragmentation = ConnectionsHandler::Fragmentation::Random;
+            } else if (mode == "whole") {
+                fragmentation = ConnectionsHandler::Fragmentation::Whole;
+            } else {
+                fragmentation = ConnectionsHandler::Fragmentation::Fixed;
+                fragment_size = std::atol(mode.c_str());
+                if (fragment_size <= 0) {
+                    return {{}, {"Invalid arguments"}};
+                }
+            }
+        } else if (option == "--zerocopy") {
+            zerocopy = true;
+        } else if (option == "--sweep" && i + 1 < argc) {
+            sweep_path = argv[++i];
+        } else if (option == "--sweep-connections" && i + 1 < argc) {
+            sweep_connections = parse_list(argv[++i]);
+        } else if (option == "--sweep-batches" && i + 1 < argc) {
+            sweep_batches = parse_list(argv[++i]);
+        } else {
+            return {{}, {"Invalid arguments"}};
+        }
+    }
+
+    if (n <= 0 || connections <= 0 || max_expr_in_req <= 0 || !ServerAddress::valid(server_addr)
+        || (server_port <= 0 && !ServerAddress::is_unix(server_addr))
+        || (rate_set && rate <= 0) || duration_s <= 0 || threads <= 0 || threads > connections
+        || max_in_flight < 0 || (max_in_flight > 0 && max_in_flight < threads) || connect_rate < 0) {
         return {{}, {"Invalid arguments"}};
     }
 
+    // By default the sweep doubles the concurrency up to <connections> at <max_expr_in_req>
+    if (sweep_connections.empty()) {
+        for (int c = 1; c < connections; c *= 2) {
+            sweep_connections.push_back(c);
+        }
+        sweep_connections.push_back(connections);
+    }
+    if (sweep_batches.empty()) {
+        sweep_batches.push_back(max_expr_in_req);
+    }
+    for (int const value: sweep_connections) {
+        if (value <= 0) return {{}, {"Invalid arguments"}};
+    }
+    for (int const value: sweep_batches) {
+        if (value <= 0) return {{}, {"Invalid arguments"}};
+    }
+
     return {CommandLineArgs{
         .n = n,
         .connections = connections,
         .server_addr = std::move(server_addr),
         .server_port = server_port,
-        .max_expr_in_req = max_expr_in_req
+        .max_expr_in_req = max_expr_in_req,
+        .binary = binary,
+        .rate = rate,
+        .duration_s = duration_s,
+        .threads = threads,
+        .corpus_path = std::move(corpus_path),
+        .max_in_flight = max_in_flight,
+        .connect_rate = connect_rate,
+        .fragmentation = fragmentation,
+        .fragment_size = static_cast<std::size_t>(fragment_size),
+        .zerocopy = zerocopy,
+        .sweep_path = std::move(sweep_path),
+        .sweep_connections = std::move(sweep_connections),
+        .sweep_batches = std::move(sweep_batches)
     }, std::nullopt};
 }
 
-void receive_callback(ConnectionsHandler::Context const &ctx, std::string data) {
-    std::istringstream results_stream(data), expressions_stream(data);
-
-    std::string expression, result;
-    while (expressions_stream >> expression) {
-        if (!(results_stream >> result)) {
+// Compares the replies to a request with the results stored in the corpus; returns how many
+// checks failed
+std::size_t verify(ConnectionsHandler::Context const &ctx, std::vector<long> const &results) {
+    std::size_t failed = 0;
+    for (std::size_t i = 0; i < ctx.expected_count; ++i) {
+        if (i == results.size()) {
             std::cerr << "Expr and Results size mismatch" << std::endl;
-            return;
+            return failed + 1;
         }
-        try {
-            long srv_res = std::stol(result);
-            long loc_res = ExprGenerator::evaluate_check(expression);
-            if (srv_res != loc_res) {
-                std::cerr << "Expr: " << ctx.expressions << " Server: " << srv_res << " Expected: " << loc_res << std::endl;
-            } else {
-                // std::cout << "Check passed!" << std::endl;
+        if (results[i] != ctx.expected[i]) {
+            std::cerr << "Expr: " << ctx.expressions << " Server: " << results[i]
+                      << " Expected: " << ctx.expected[i] << std::endl;
+            ++failed;
+        }
+    }
+    return failed;
+}
+
+std::size_t receive_callback(ConnectionsHandler::Context const &ctx, std::string const &data) {
+    if (ctx.binary) {
+        return verify(ctx, BinaryProtocol::decode_results(data));
+    }
+
+    std::vector<long> results;
+    char const *p = data.c_str();
+    while (true) {
+        while (*p == ' ' || *p == '\n' || *p == '\t' || *p == '\r') ++p;
+        if (*p == '\0') break;
+        char *end = nullptr;
+        long const result = std::strtol(p, &end, 10);
+        if (end == p) {
+            std::cerr << "Invalid result: " << p << std::endl;
+            return ctx.expected_count;
+        }
+        results.push_back(result);
+        p = end;
+    }
+    return verify(ctx, results);
+}
+
+// Requests of the open-loop mode are reused cyclically, so producing them does not eat into
+// the schedule
+constexpr std::size_t OPEN_LOOP_REQUESTS = 1024;
+// Beyond this many connections generated requests are reused too
+constexpr std::size_t MAX_GENERATED_REQUESTS = 1 << 16;
+
+std::vector<LoadRunner::Request> requests_of(Corpus const &corpus, bool binary) {
+    std::vector<LoadRunner::Request> requests(corpus.size());
+    for (std::size_t i = 0; i < corpus.size(); ++i) {
+        requests[i] = {
+            // The connection sends MAGIC once, requests carry only their frames
+            .payload = binary ? corpus.binary(i).substr(1) : corpus.text(i),
+            .expected = corpus.expected(i),
+            .expected_count = corpus.expected_count(i)
+        };
+    }
+    return requests;
+}
+
+// Runs the persistent-connection load (closed loop when rate is 0) on args.threads runners.
+// Every thread gets an equal share of the rate and of the connections, which are all
+// established before any schedule starts.
+std::optional<LoadRunner::Report> run_load(CommandLineArgs const &args, int connections,
+                                           std::vector<LoadRunner::Request> const &requests, double rate) {
+    ServerAddress const server(args.server_addr, args.server_port);
+    int const threads = std::min(args.threads, connections);
+    std::vector<std::unique_ptr<LoadRunner>> runners;
+    for (int t = 0; t < threads; ++t) {
+        runners.push_back(std::make_unique<LoadRunner>(server, args.binary));
+    }
+    for (int i = 0; i < connections; ++i) {
+        if (!runners[i % threads]->create_new_connection()) {
+            return std::nullopt;
+        }
+    }
+
+    std::vector<LoadRunner::Report> reports(threads);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            reports[t] = runners[t]->run(requests, rate / threads, args.duration_s);
+        });
+    }
+    LoadRunner::Report report;
+    for (int t = 0; t < threads; ++t) {
+        workers[t].join();
+        report.merge(reports[t]);
+    }
+    return report;
+}
+
+double percentile_us(LoadRunner::Report const &report, double percent) {
+    return static_cast<double>(report.latency.percentile(percent)) / 1000.0;
+}
+
+int run_open_loop(CommandLineArgs const &args, Corpus const &corpus) {
+    std::vector<LoadRunner::Request> const requests = requests_of(corpus, args.binary);
+    std::cout << "Sending " << args.rate << " req/s over " << args.connections << " connections for "
+              << args.duration_s << " s..." << std::endl;
+    std::optional<LoadRunner::Report> const result = run_load(args, args.connections, requests, args.rate);
+    if (!result.has_value()) {
+        return EXIT_FAILURE;
+    }
+    LoadRunner::Report const &report = *result;
+    std::cout << "Requests issued: " << report.issued << ", completed: " << report.completed
+              << ", failed: " << report.failed << ", mismatches: " << report.mismatches
+              << ", elapsed: " << report.elapsed_s << " s"
+              << ", " << static_cast<double>(report.completed) / report.elapsed_s << " req/s" << std::endl;
+    std::cout << "Latency from intended send time, us: p50 " << percentile_us(report, 50)
+              << ", p99 " << percentile_us(report, 99) << ", p99.9 " << percentile_us(report, 99.9)
+              << ", max " << static_cast<double>(report.latency.max()) / 1000.0 << std::endl;
+    return report.failed == 0 && report.mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Runs every combination of concurrency and batch size for duration_s over persistent
+// connections, closed loop unless a rate is given, and appends a CSV row per point. Batch sizes
+// are exact expression counts per request of a generated corpus, or the corpus file as is.
+int run_sweep(CommandLineArgs const &args, Corpus const &file_corpus) {
+    std::ofstream csv(args.sweep_path);
+    if (!csv) {
+        std::cerr << "Cannot write " << args.sweep_path << std::endl;
+        return EXIT_FAILURE;
+    }
+    csv << "connections,expr_per_req,requests,expressions,failed,mismatches,elapsed_s,req_per_s,expr_per_s,"
+           "p50_us,p99_us,p999_us,max_us\n";
+
+    std::vector<int> batches = args.sweep_batches;
+    if (!args.corpus_path.empty()) {
+        batches = {0};
+    }
+    bool ok = true;
+    for (int const batch: batches) {
+        Corpus generated;
+        if (batch > 0) {
+            generated.load(Corpus::generate(OPEN_LOOP_REQUESTS, args.n, batch, batch, std::random_device{}()));
+        }
+        std::vector<LoadRunner::Request> const requests = requests_of(batch > 0 ? generated : file_corpus,
+                                                                      args.binary);
+        for (int const connections: args.sweep_connections) {
+            std::optional<LoadRunner::Report> const result = run_load(args, connections, requests, args.rate);
+            if (!result.has_value()) {
+                return EXIT_FAILURE;
+            }
+            LoadRunner::Report const &report = *result;
+            double const req_per_s = static_cast<double>(report.completed) / report.elapsed_s;
+            double const expr_per_s = static_cast<double>(report.expressions) / report.elapsed_s;
+            csv << connections << ',';
+            if (batch > 0) {
+                csv << batch;
             }
-        } catch (std::invalid_argument const &e) {
-            std::cerr << e.what() << std::endl;
-            std::cerr << result.data() << std::endl;
+            csv << ',' << report.completed << ',' << report.expressions << ',' << report.failed << ','
+                << report.mismatches << ',' << report.elapsed_s << ',' << req_per_s << ',' << expr_per_s << ','
+                << percentile_us(report, 50) << ',' << percentile_us(report, 99) << ','
+                << percentile_us(report, 99.9) << ',' << static_cast<double>(report.latency.max()) / 1000.0
+                << '\n' << std::flush;
+            std::cout << "connections " << connections << ", expr/req " << (batch > 0 ? std::to_string(batch) : "corpus")
+                      << ": " << req_per_s << " req/s, " << expr_per_s << " expr/s, p99 "
+                      << percentile_us(report, 99) << " us, failed " << report.failed
+                      << ", mismatches " << report.mismatches << std::endl;
+            ok = ok && report.failed == 0 && report.mismatches == 0;
         }
     }
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 int main(int argc, char *argv[]) {
@@ -70,30 +351,116 @@ int main(int argc, char *argv[]) {
         return EXIT_FAILURE;
     }
 
-    std::cout << "Establishing " << args.connections << " connections..." << std::endl;
+    // Without a corpus file one is generated for this run, with a request per connection up to
+    // MAX_GENERATED_REQUESTS
+    Corpus corpus;
+    if (!args.corpus_path.empty()) {
+        if (!corpus.open(args.corpus_path)) {
+            std::cerr << "Invalid corpus " << args.corpus_path << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    if (!args.sweep_path.empty()) {
+        return run_sweep(args, corpus);
+    }
+    if (args.corpus_path.empty()) {
+        std::cout << "Generating expressions..." << std::endl;
+        std::uint64_t const requests = args.rate > 0
+                                           ? OPEN_LOOP_REQUESTS
+                                           : std::min<std::uint64_t>(args.connections, MAX_GENERATED_REQUESTS);
+        corpus.load(Corpus::generate(requests, args.n, 1, args.max_expr_in_req, std::random_device{}()));
+    }
 
-    ConnectionsHandler connections_handler(args.server_addr, args.server_port, args.n);
-    ExprGenerator expr_generator{};
+    if (args.rate > 0) {
+        return run_open_loop(args, corpus);
+    }
 
-    std::cout << "Generating expressions..." << std::endl;
+    // Timed from the first connect, so a storm of short connections measures the accept path too.
+    // Thread t drives connections t, t + threads, ... on its own epoll instance, connection i
+    // sending request i mod corpus size straight from the corpus.
+    struct ThreadResult {
+        std::size_t bytes_sent = 0;
+        std::size_t bytes_received = 0;
+        std::size_t expressions = 0;
+        std::size_t connections_failed = 0;
+        std::size_t failed = 0;
+        std::size_t zerocopy_sends = 0;
+        std::size_t zerocopy_copied = 0;
+    };
+    std::vector<ThreadResult> results(args.threads);
+    ServerAddress const server(args.server_addr, args.server_port);
+    ConnectionsHandler::Options const options{
+        .connect_rate = args.connect_rate / args.threads,
+        .fragmentation = args.fragmentation,
+        .fragment_size = args.fragment_size,
+        .zerocopy = args.zerocopy
+    };
 
-    std::size_t total_sent = 0;
+    std::cout << "Sending over " << args.connections << " connections..." << std::endl;
+    auto const start = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (int t = 0; t < args.threads; ++t) {
+        workers.emplace_back([&, t] {
+            ThreadResult &result = results[t];
+            auto i = static_cast<std::size_t>(t);
+            auto next_context = [&]() -> std::optional<ConnectionsHandler::Context> {
+                if (i >= static_cast<std::size_t>(args.connections)) {
+                    return std::nullopt;
+                }
+                std::size_t const r = i % corpus.size();
+                i += args.threads;
+                result.expressions += corpus.expected_count(r);
+                return ConnectionsHandler::Context{
+                    .expressions = corpus.text(r),
+                    .payload = args.binary ? corpus.binary(r) : corpus.text(r),
+                    .expected = corpus.expected(r),
+                    .expected_count = corpus.expected_count(r),
+                    .binary = args.binary
+                };
+            };
 
-    for (int i = 0; i < args.connections; ++i) {
-        std::ostringstream oss;
-        std::size_t expr_cnt = random_int(1, args.max_expr_in_req);
-        for (std::size_t j = 0; j < expr_cnt; ++j) {
-            oss << expr_generator.gen_expr(args.n);
-            if (j != expr_cnt - 1) {
-                oss << ' ';
+            // The in-flight limit is split like the connections, so the threads together keep to it
+            ConnectionsHandler::Options thread_options = options;
+            if (args.max_in_flight > 0) {
+                thread_options.max_in_flight = static_cast<std::size_t>(
+                    args.max_in_flight / args.threads + (t < args.max_in_flight % args.threads));
             }
-        }
-        connections_handler.create_new_connection({.expressions = oss.str()});
-        total_sent += expr_cnt;
+            ConnectionsHandler connections_handler(server, args.n, thread_options);
+            connections_handler.send_all(next_context, [&result](ConnectionsHandler::Context const &ctx,
+                                                                 std::string data) {
+                result.failed += receive_callback(ctx, data);
+            });
+            result.bytes_sent = connections_handler.get_bytes_sent();
+            result.bytes_received = connections_handler.get_bytes_received();
+            result.connections_failed = connections_handler.get_connections_failed();
+            result.zerocopy_sends = connections_handler.get_zerocopy_sends();
+            result.zerocopy_copied = connections_handler.get_zerocopy_copied();
+        });
     }
-
-    std::cout << "Sending " << total_sent << " expressions..." << std::endl;
-    connections_handler.send_all(receive_callback);
+    ThreadResult total;
+    for (int t = 0; t < args.threads; ++t) {
+        workers[t].join();
+        total.bytes_sent += results[t].bytes_sent;
+        total.bytes_received += results[t].bytes_received;
+        total.expressions += results[t].expressions;
+        total.connections_failed += results[t].connections_failed;
+        total.failed += results[t].failed;
+        total.zerocopy_sends += results[t].zerocopy_sends;
+        total.zerocopy_copied += results[t].zerocopy_copied;
+    }
+    std::chrono::duration<double> const elapsed = std::chrono::steady_clock::now() - start;
     std::cout << "Sending ended" << std::endl;
-    return 0;
+    std::cout << "Bytes sent: " << total.bytes_sent
+              << ", bytes received: " << total.bytes_received
+              << ", failed connections: " << total.connections_failed
+              << ", failed checks: " << total.failed
+              << ", elapsed: " << elapsed.count() << " s"
+              << ", " << static_cast<double>(total.expressions) / elapsed.count() << " expr/s"
+              << ", " << static_cast<double>(args.connections) / elapsed.count() << " conn/s" << std::endl;
+    if (args.zerocopy) {
+        // Loopback and AF_UNIX have no device to hand pages to, the kernel copies them anyway
+        std::cout << "Zerocopy sends: " << total.zerocopy_sends << ", copied by the kernel: "
+                  << total.zerocopy_copied << std::endl;
+    }
+    return total.failed == 0 && total.connections_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -0,0 +1,52 @@
+#ifndef ADMISSIONCONTROL_H
+#define ADMISSIONCONTROL_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "ServerOptions.h"
+
+
+// Decides whether the server is overloaded from the event loop lag and the amount of reply
+// data still queued. It switches on when either crosses its limit and back off only once both
+// fall under half of it, so the server does not flap between the two states.
+class AdmissionControl {
+    std::uint64_t const max_lag_ns;
+    std::size_t const max_pending_output;
+    // Exponentially weighted average of the iteration time, weight 1/8
+    std::uint64_t lag_ns = 0;
+    bool overloaded = false;
+
+public:
+    // Sent to connections rejected under the Reject policy
+    static constexpr char REJECT_MESSAGE[] = "overloaded\n";
+
+    explicit AdmissionControl(ServerOptions const &options)
+        : max_lag_ns(static_cast<std::uint64_t>(options.max_loop_lag_ms) * 1000000),
+          max_pending_output(options.max_pending_output) {
+    }
+
+    bool enabled() const {
+        return max_lag_ns > 0 || max_pending_output > 0;
+    }
+
+    // Called once per event loop iteration with the time it took to handle its events
+    bool update(std::uint64_t busy_ns, std::size_t pending_output) {
+        lag_ns = lag_ns - lag_ns / 8 + busy_ns / 8;
+        bool const lag_high = max_lag_ns > 0 && lag_ns > max_lag_ns;
+        bool const output_high = max_pending_output > 0 && pending_output > max_pending_output;
+        if (lag_high || output_high) {
+            overloaded = true;
+        } else if ((max_lag_ns == 0 || lag_ns < max_lag_ns / 2)
+                   && (max_pending_output == 0 || pending_output < max_pending_output / 2)) {
+            overloaded = false;
+        }
+        return overloaded;
+    }
+
+    bool is_overloaded() const {
+        return overloaded;
+    }
+};
+
+#endif //ADMISSIONCONTROL_H
@@ -0,0 +1,252 @@
+#ifndef BATCHEVALUATOR_H
+#define BATCHEVALUATOR_H
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "Calculator.h"
+#include "ExpressionScanner.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BATCH_EVALUATOR_X86 1
+#endif
+
+
+// Evaluates expressions with the same number of operands side by side. Expressions are
+// collected in structure-of-arrays form, operands and operator codes per position, and the
+// batch is folded position by position in AVX2 registers, LANES expressions per register: the
+// operator codes become lane masks that pick between multiplying, dividing and starting a new term.
+// The arithmetic matches Calculator::Accumulator exactly: products wrap like the scalar
+// imul, and quotients go through doubles only when both sides are below 2^51, where the
+// truncated double quotient is the exact integer one; any other division lane is done with
+// the scalar operator. Without AVX2 the same layout is folded lane by lane.
+class BatchEvaluator {
+public:
+    static constexpr std::size_t LANES = 4;
+    static constexpr std::size_t CAPACITY = 16;
+    static constexpr std::size_t GROUPS = CAPACITY / LANES;
+
+private:
+    enum Code : std::uint8_t {
+        ADD,
+        SUB,
+        MUL,
+        DIV
+    };
+
+    bool const use_avx2;
+    std::size_t length = 0;
+    std::size_t size = 0;
+    // Position-major: the operand at position p of slot s is operands[p * CAPACITY + s]
+    std::vector<long> operands;
+    std::vector<std::uint8_t> codes;
+    std::size_t indices[CAPACITY]{};
+
+    static constexpr std::uint8_t INVALID = 0x80;
+
+    struct CodeTable {
+        std::uint8_t codes[256]{};
+
+        constexpr CodeTable() {
+            for (auto &code: codes) code = INVALID;
+            codes[static_cast<unsigned char>('+')] = ADD;
+            codes[static_cast<unsigned char>('-')] = SUB;
+            codes[static_cast<unsigned char>('*')] = MUL;
+            codes[static_cast<unsigned char>('/')] = DIV;
+        }
+    };
+
+    // A table rather than a switch: operators are random enough to defeat the branch predictor
+    static std::uint8_t code_of(char op) {
+        static constexpr CodeTable table{};
+        return table.codes[static_cast<unsigned char>(op)];
+    }
+
+    void evaluate_scalar(long *values) const {
+        for (std::size_t slot = 0; slot < size; ++slot) {
+            static constexpr char ops[] = {'+', '-', '*', '/'};
+            Calculator::Accumulator acc;
+            for (std::size_t p = 0; p < length; ++p) {
+                acc.apply(ops[codes[p * CAPACITY + slot]], operands[p * CAPACITY + slot]);
+            }
+            values[slot] = acc.value();
+        }
+    }
+
+#ifdef BATCH_EVALUATOR_X86
+    // Low 64 bits of the product, from 32-bit partial products
+    __attribute__((target("avx2")))
+    static __m256i multiply(__m256i a, __m256i b) {
+        __m256i const low = _mm256_mul_epu32(a, b);
+        __m256i const cross = _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), b),
+                                               _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+        return _mm256_add_epi64(low, _mm256_slli_epi64(cross, 32));
+    }
+
+    __attribute__((target("avx2")))
+    static __m256i abs64(__m256i v) {
+        __m256i const sign = _mm256_cmpgt_epi64(_mm256_setzero_si256(), v);
+        return _mm256_sub_epi64(_mm256_xor_si256(v, sign), sign);
+    }
+
+    // Lanes with |v| > 2^51, including INT64_MIN, whose abs64 stays negative
+    __attribute__((target("avx2")))
+    static __m256i beyond_double(__m256i v) {
+        __m256i const magnitude = abs64(v);
+        return _mm256_or_si256(_mm256_cmpgt_epi64(magnitude, _mm256_set1_epi64x(1ll << 51)),
+                               _mm256_cmpgt_epi64(_mm256_setzero_si256(), magnitude));
+    }
+
+    // Exact conversions for |v| <= 2^51 by way of the 2^52 + 2^51 magic constant
+    __attribute__((target("avx2")))
+    static __m256d to_double(__m256i v) {
+        __m256i const magic = _mm256_set1_epi64x(0x4338000000000000);
+        return _mm256_sub_pd(_mm256_castsi256_pd(_mm256_add_epi64(v, magic)), _mm256_set1_pd(6755399441055744.0));
+    }
+
+    __attribute__((target("avx2")))
+    static __m256i to_integer(__m256d v) {
+        __m256i const magic = _mm256_set1_epi64x(0x4338000000000000);
+        return _mm256_sub_epi64(_mm256_castpd_si256(_mm256_add_pd(v, _mm256_set1_pd(6755399441055744.0))), magic);
+    }
+
+    // Quotients of the lanes selected by mask, other lanes are unspecified
+    __attribute__((target("avx2")))
+    static __m256i divide(__m256i a, __m256i b, __m256i mask) {
+        __m256i const unsafe = _mm256_or_si256(beyond_double(a),
+                                               _mm256_or_si256(beyond_double(b),
+                                                               _mm256_cmpeq_epi64(b, _mm256_setzero_si256())));
+        if (_mm256_testz_si256(unsafe, mask)) {
+            __m256d const quotient = _mm256_div_pd(to_double(a), to_double(b));
+            return to_integer(_mm256_round_pd(quotient, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC));
+        }
+        alignas(32) long dividends[LANES], divisors[LANES], selected[LANES];
+        _mm256_store_si256(reinterpret_cast<__m256i *>(dividends), a);
+        _mm256_store_si256(reinterpret_cast<__m256i *>(divisors), b);
+        _mm256_store_si256(reinterpret_cast<__m256i *>(selected), mask);
+        for (std::size_t lane = 0; lane < LANES; ++lane) {
+            dividends[lane] = selected[lane] ? dividends[lane] / divisors[lane] : 0;
+        }
+        return _mm256_load_si256(reinterpret_cast<__m256i const *>(dividends));
+    }
+
+    __attribute__((target("avx2")))
+    static __m256i load_codes(std::uint8_t const *codes) {
+        std::int32_t packed;
+        std::memcpy(&packed, codes, sizeof(packed));
+        return _mm256_cvtepu8_epi64(_mm_cvtsi32_si128(packed));
+    }
+
+    // Folds all GROUPS groups of the batch together: each group is an independent dependency
+    // chain, so the latency of one group's division or multiplication is hidden behind the others.
+    // result and term are the Accumulator state per lane; negative is all ones where the current
+    // term is subtracted.
+    __attribute__((target("avx2")))
+    void evaluate_avx2(long *values) const {
+        __m256i const mul_code = _mm256_set1_epi64x(MUL), div_code = _mm256_set1_epi64x(DIV);
+        __m256i const sub_code = _mm256_set1_epi64x(SUB);
+        __m256i result[GROUPS], term[GROUPS], negative[GROUPS];
+        for (std::size_t g = 0; g < GROUPS; ++g) {
+            result[g] = _mm256_setzero_si256();
+            term[g] = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(&operands[g * LANES]));
+            negative[g] = _mm256_cmpeq_epi64(load_codes(&codes[g * LANES]), sub_code);
+        }
+
+        for (std::size_t p = 1; p < length; ++p) {
+            for (std::size_t g = 0; g < GROUPS; ++g) {
+                std::size_t const at = p * CAPACITY + g * LANES;
+                __m256i const x = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(&operands[at]));
+                __m256i const code = load_codes(&codes[at]);
+                __m256i const is_mul = _mm256_cmpeq_epi64(code, mul_code);
+                __m256i const is_div = _mm256_cmpeq_epi64(code, div_code);
+                __m256i const is_new = _mm256_xor_si256(_mm256_or_si256(is_mul, is_div), _mm256_set1_epi64x(-1));
+
+                __m256i const signed_term = _mm256_sub_epi64(_mm256_xor_si256(term[g], negative[g]), negative[g]);
+                result[g] = _mm256_add_epi64(result[g], _mm256_and_si256(signed_term, is_new));
+                negative[g] = _mm256_blendv_epi8(negative[g], _mm256_cmpeq_epi64(code, sub_code), is_new);
+
+                __m256i const next = _mm256_blendv_epi8(x, multiply(term[g], x), is_mul);
+                term[g] = _mm256_blendv_epi8(next, divide(term[g], x, is_div), is_div);
+            }
+        }
+        for (std::size_t g = 0; g < GROUPS; ++g) {
+            __m256i const signed_term = _mm256_sub_epi64(_mm256_xor_si256(term[g], negative[g]), negative[g]);
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(values + g * LANES), _mm256_add_epi64(result[g], signed_term));
+        }
+    }
+#endif
+
+public:
+    explicit BatchEvaluator(bool allow_simd = true)
+#ifdef BATCH_EVALUATOR_X86
+        : use_avx2(allow_simd && __builtin_cpu_supports("avx2")) {
+#else
+        : use_avx2(false) {
+        (void) allow_simd;
+#endif
+    }
+
+    // Queues an expression whose result store(index, value) receives on a later flush. Returns
+    // false without queuing it for single operands, which need no evaluation, expressions starting
+    // with * or / and operators Calculator treats as generic subtraction; those are evaluated by
+    // the caller.
+    template<typename Store>
+    bool add(ExpressionScanner::Token const *tokens, std::size_t count, std::size_t index, Store &&store) {
+        if (count < 2 || (tokens[0].op != '+' && tokens[0].op != '-')) {
+            return false;
+        }
+        if (count != length || size == CAPACITY) {
+            flush(store);
+            length = count;
+            if (operands.size() < count * CAPACITY) {
+                operands.resize(count * CAPACITY);
+                codes.resize(count * CAPACITY);
+            }
+        }
+        // Through locals: stores to the uint8_t codes may alias anything, including the members
+        long *operand = operands.data() + size;
+        std::uint8_t *code = codes.data() + size;
+        std::uint8_t seen = 0;
+        for (std::size_t p = 0; p < count; ++p, operand += CAPACITY, code += CAPACITY) {
+            *code = code_of(tokens[p].op);
+            *operand = tokens[p].operand;
+            seen |= *code;
+        }
+        if (seen & INVALID) {
+            return false;
+        }
+        indices[size++] = index;
+        return true;
+    }
+
+    template<typename Store>
+    void flush(Store &&store) {
+        if (size == 0) {
+            return;
+        }
+        // Unused slots compute 1 + 1 + ... and are dropped
+        for (std::size_t p = 0; p < length; ++p) {
+            for (std::size_t slot = size; slot < CAPACITY; ++slot) {
+                operands[p * CAPACITY + slot] = 1;
+                codes[p * CAPACITY + slot] = ADD;
+            }
+        }
+        long values[CAPACITY];
+#ifdef BATCH_EVALUATOR_X86
+        if (use_avx2) {
+            evaluate_avx2(values);
+        } else
+#endif
+        {
+            evaluate_scalar(values);
+        }
+        for (std::size_t slot = 0; slot < size; ++slot) {
+            store(indices[slot], values[slot]);
+        }
+        size = 0;
+    }
+};
+
+#endif //BATCHEVALUATOR_H
@@ -0,0 +1,88 @@
+#ifndef BINARYPROTOCOL_H
+#define BINARYPROTOCOL_H
+
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <string_view>
+
+
+// Opt-in binary protocol. A connection whose first byte is MAGIC carries a sequence of frames
+//   frame   := varint(payload size) payload
+//   payload := varint(zigzag(operand)) { varint(zigzag(operand) << 2 | opcode) }
+// with opcodes 0..3 for + - * /. Every frame is answered with its int64 result as
+// varint(zigzag(result)); a malformed frame gets ERROR_RESULT.
+class BinaryProtocol {
+public:
+    static constexpr unsigned char MAGIC = 0xCA;
+    static constexpr std::int64_t ERROR_RESULT = std::numeric_limits<std::int64_t>::min();
+
+    static bool read_varint(std::string_view &data, std::uint64_t &value) {
+        value = 0;
+        for (unsigned shift = 0; shift < 64 && !data.empty(); shift += 7) {
+            auto const byte = static_cast<unsigned char>(data.front());
+            data.remove_prefix(1);
+            value |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Length of the longest prefix of data made of whole frames
+    static std::size_t complete_prefix(std::string_view data) {
+        std::size_t done = 0;
+        std::string_view rest = data;
+        std::uint64_t size;
+        while (read_varint(rest, size) && size <= rest.size()) {
+            rest.remove_prefix(size);
+            done = data.size() - rest.size();
+        }
+        return done;
+    }
+
+    // Calls on_frame(payload) for every whole frame in data
+    template<typename OnFrame>
+    static void for_each_frame(std::string_view data, OnFrame &&on_frame) {
+        std::uint64_t size;
+        while (read_varint(data, size) && size <= data.size()) {
+            on_frame(data.substr(0, size));
+            data.remove_prefix(size);
+        }
+    }
+
+    // Calls on_operand(op, operand) for every operand of the payload, the first one with '+'
+    template<typename OnOperand>
+    static bool decode(std::string_view payload, OnOperand &&on_operand) {
+        static constexpr char ops[] = {'+', '-', '*', '/'};
+        std::uint64_t value;
+        if (!read_varint(payload, value)) {
+            return false;
+        }
+        on_operand('+', unzigzag(value));
+        while (!payload.empty()) {
+            if (!read_varint(payload, value)) {
+                return false;
+            }
+            on_operand(ops[value & 3], unzigzag(value >> 2));
+        }
+        return true;
+    }
+
+    static void append_result(std::string &out, std::int64_t result) {
+        auto value = static_cast<std::uint64_t>(result) << 1 ^ static_cast<std::uint64_t>(result >> 63);
+        while (value >= 0x80) {
+            out.push_back(static_cast<char>(value | 0x80));
+            value >>= 7;
+        }
+        out.push_back(static_cast<char>(value));
+    }
+
+private:
+    static std::int64_t unzigzag(std::uint64_t value) {
+        return static_cast<std::int64_t>(value >> 1) ^ -static_cast<std::int64_t>(value & 1);
+    }
+};
+
+#endif //BINARYPROTOCOL_H
@@ -0,0 +1,79 @@
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+
+#include <cstddef>
+#include <vector>
+
+
+// Recycles receive buffers in power-of-two size classes from 1 KiB to 1 MiB,
+// so a server in steady state takes them from the free lists instead of the heap.
+class BufferPool {
+public:
+    struct Buffer {
+        char *data = nullptr;
+        std::size_t capacity = 0;
+    };
+
+private:
+    static constexpr std::size_t MIN_CLASS_SHIFT = 10;
+    static constexpr std::size_t CLASS_COUNT = 11;
+    static constexpr std::size_t MAX_CACHED_BYTES_PER_CLASS = 16 << 20;
+
+    std::vector<char *> free_lists[CLASS_COUNT];
+
+    static std::size_t class_size(std::size_t cls) {
+        return std::size_t{1} << (cls + MIN_CLASS_SHIFT);
+    }
+
+    static std::size_t class_of(std::size_t size) {
+        std::size_t cls = 0;
+        while (cls < CLASS_COUNT && class_size(cls) < size) {
+            ++cls;
+        }
+        return cls;
+    }
+
+public:
+    BufferPool() = default;
+
+    BufferPool(BufferPool const &) = delete;
+
+    BufferPool &operator=(BufferPool const &) = delete;
+
+    Buffer acquire(std::size_t min_size) {
+        std::size_t const cls = class_of(min_size);
+        if (cls == CLASS_COUNT) {
+            return {new char[min_size], min_size};
+        }
+        std::vector<char *> &free_list = free_lists[cls];
+        if (free_list.empty()) {
+            return {new char[class_size(cls)], class_size(cls)};
+        }
+        char *data = free_list.back();
+        free_list.pop_back();
+        return {data, class_size(cls)};
+    }
+
+    void release(Buffer buffer) {
+        if (buffer.data == nullptr) {
+            return;
+        }
+        std::size_t const cls = class_of(buffer.capacity);
+        if (cls == CLASS_COUNT || class_size(cls) != buffer.capacity
+            || (free_lists[cls].size() + 1) * buffer.capacity > MAX_CACHED_BYTES_PER_CLASS) {
+            delete[] buffer.data;
+            return;
+        }
+        free_lists[cls].push_back(buffer.data);
+    }
+
+    ~BufferPool() {
+        for (auto &free_list: free_lists) {
+            for (char *data: free_list) {
+                delete[] data;
+            }
+        }
+    }
+};
+
+#endif //BUFFERPOOL_H
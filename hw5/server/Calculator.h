@@ -3,40 +3,50 @@
 
 #include <sstream>
 #include <string>
-#include <vector>
 
 
 class Calculator {
 public:
+    // Folds an expression operand by operand: * and / bind to the current term,
+    // + and - start a new one. The first operand is applied with '+'.
+    class Accumulator {
+        long result = 0;
+        long term = 0;
+        char term_op = '+';
+
+    public:
+        void apply(char op, long num) {
+            switch (op) {
+                case '*':
+                    term *= num;
+                    break;
+                case '/':
+                    term /= num;
+                    break;
+                default:
+                    result = value();
+                    term_op = op;
+                    term = num;
+            }
+        }
+
+        long value() const {
+            return term_op == '+' ? result + term : result - term;
+        }
+    };
+
     static long evaluate(const std::string &expr) {
-        std::vector<long> nums;
-        std::vector<char> ops;
         std::istringstream ss(expr);
-        long num;
+        Accumulator acc;
+        long num = 0;
         char op;
 
         ss >> num;
-        nums.push_back(num);
+        acc.apply('+', num);
         while (ss >> op >> num) {
-            ops.push_back(op);
-            nums.push_back(num);
-        }
-        for (std::size_t i = 0; i < ops.size();) {
-            if (ops[i] == '*' || ops[i] == '/') {
-                long const a = nums[i], b = nums[i + 1];
-                long const res = (ops[i] == '*') ? a * b : a / b;
-
-                nums[i] = res;
-                nums.erase(std::next(nums.begin(), i + 1));
-                ops.erase(std::next(ops.begin(), i));
-            } else ++i;
-        }
-        long result = nums[0];
-        for (size_t i = 0; i < ops.size(); ++i) {
-            if (ops[i] == '+') result += nums[i + 1];
-            else result -= nums[i + 1];
+            acc.apply(op, num);
         }
-        return result;
+        return acc.value();
     }
 };
 
@@ -0,0 +1,60 @@
+#ifndef CONNECTIONTABLE_H
+#define CONNECTIONTABLE_H
+
+#include <cstdint>
+#include <deque>
+
+
+// Connection state stored densely by fd. Every open bumps the slot generation, so an event
+// that still carries the generation of a closed connection is recognized even if the kernel
+// has already handed the same fd to a new one. Slots live in a deque: growing the table
+// never moves a connection whose buffers may still be referenced by in-flight I/O.
+template<typename Connection>
+class ConnectionTable {
+    struct Slot {
+        Connection conn;
+        std::uint32_t generation = 0;
+        bool used = false;
+    };
+
+    std::deque<Slot> slots;
+
+public:
+    static std::uint64_t key(int fd, std::uint32_t generation) {
+        return static_cast<std::uint64_t>(generation) << 32 | static_cast<std::uint32_t>(fd);
+    }
+
+    static int fd_of(std::uint64_t key) {
+        return static_cast<int>(key & 0xffffffff);
+    }
+
+    static std::uint32_t generation_of(std::uint64_t key) {
+        return static_cast<std::uint32_t>(key >> 32);
+    }
+
+    std::uint32_t open(int fd) {
+        if (static_cast<std::size_t>(fd) >= slots.size()) {
+            slots.resize(static_cast<std::size_t>(fd) + 1);
+        }
+        Slot &slot = slots[fd];
+        slot.used = true;
+        return ++slot.generation;
+    }
+
+    Connection *find(int fd, std::uint32_t generation) {
+        if (fd < 0 || static_cast<std::size_t>(fd) >= slots.size()) {
+            return nullptr;
+        }
+        Slot &slot = slots[fd];
+        return slot.used && slot.generation == generation ? &slot.conn : nullptr;
+    }
+
+    // The slot keeps its members, so buffers the connection owned can be reused by the next one
+    void close(int fd) {
+        Slot &slot = slots[fd];
+        slot.used = false;
+        ++slot.generation;
+    }
+};
+
+#endif //CONNECTIONTABLE_H
@@ -2,134 +2,412 @@
 #define CONNECTIONSHANDLER_H
 
 #include <iostream>
-#include <unordered_map>
 #include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
 #include <cerrno>
+#include <cstdint>
 
 #include <fcntl.h>
 #include <netinet/in.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 
+#include "AdmissionControl.h"
+#include "BufferPool.h"
+#include "ConnectionTable.h"
+#include "Handler.h"
+#include "Listener.h"
+#include "Metrics.h"
+#include "RequestAssembler.h"
+#include "ServerOptions.h"
+#include "Stream.h"
+#include "TimerWheel.h"
+
 
 class ConnectionsHandler {
 public:
-    using ReceiveCallback = std::function<std::string(std::string)>;
+    // Called with complete expressions as they arrive, possibly several times per connection
+    using ReceiveCallback = std::function<std::string(std::string_view, Protocol)>;
+    // Starts the coroutine serving a new connection
+    using StreamHandler = std::function<Handler(Stream &)>;
 
 private:
     static constexpr int MAX_EVENTS = 1000;
+    // Connections taken from the backlog per wakeup, so a storm does not starve open ones
+    static constexpr int ACCEPT_BATCH = 256;
     static constexpr int BUF_SIZE = 1024;
+    static constexpr std::uint64_t TICK_MS = 100;
+    static constexpr std::uint64_t FD_WARNING_INTERVAL_NS = 1000000000;
 
-    int const port;
+    ServerOptions const options;
+    std::uint64_t const idle_ticks;
+    std::uint64_t const read_ticks;
 
     int const epoll_fd;
     int const listen_fd;
+    int const timer_fd;
+    // Held back for accepting and closing a connection when the descriptors run out
+    int spare_fd;
+    std::uint64_t refused = 0;
+    std::uint64_t last_fd_warning = 0;
     epoll_event ev{}, events[MAX_EVENTS]{};
 
-    static int set_nonblocking(int fd) {
-        int flags = fcntl(fd, F_GETFL, 0);
-        if (flags == -1) return -1;
-        return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    // Connection deadlines are checked lazily: activity only stores the current tick, and an
+    // expired timer is pushed forward to the real deadline, so the wheel is not touched per read.
+    struct Connection {
+        Stream stream;
+        Handler handler;
+        TimerWheel::Node timer;
+        std::uint64_t last_activity = 0;
+        std::uint64_t read_deadline = 0;
+        std::uint64_t accepted_at = 0;
+        // Part of stream.bytes_received() already accounted in the metrics
+        std::uint64_t counted = 0;
+        std::uint32_t interest = 0;
+    };
+
+    ConnectionTable<Connection> conns;
+    BufferPool pool;
+    TimerWheel timers;
+    AdmissionControl admission;
+    // Tick of the current event loop iteration
+    std::uint64_t now;
+    std::size_t active = 0;
+    std::size_t pending_output = 0;
+    bool accepting = true;
+
+    static std::uint64_t now_ticks() {
+        return Metrics::now_ns() / 1000000 / TICK_MS;
     }
 
-public:
-    explicit ConnectionsHandler(int const port)
-        : port(port), epoll_fd(epoll_create1(0)), listen_fd(socket(AF_INET, SOCK_STREAM, 0)) {
-        if (listen_fd < 0) {
-            perror("socket");
+    static std::uint64_t ticks_of(unsigned ms) {
+        return (ms + TICK_MS - 1) / TICK_MS;
+    }
+
+    std::uint64_t deadline_of(Connection const &c) const {
+        std::uint64_t deadline = UINT64_MAX;
+        if (idle_ticks > 0) {
+            deadline = c.last_activity + idle_ticks;
+        }
+        if (read_ticks > 0 && !c.stream.at_eof()) {
+            deadline = std::min(deadline, c.read_deadline);
+        }
+        return deadline;
+    }
+
+    // The callback API on top of the stream one: reads go straight into the assembler buffer,
+    // complete expressions are passed to the callback and its replies are queued in order on the
+    // stream of the slot, so a connection allocates no reply buffer of its own. A handler
+    // suspended in drain() reads nothing more, so a peer that does not take its replies is
+    // throttled by TCP flow control.
+    static Handler assemble(Stream &stream, ReceiveCallback const &receive_callback, BufferPool &pool) {
+        RequestAssembler request;
+        auto emit = [&stream](std::string out) { stream.queue(std::move(out)); };
+        bool open = true;
+        while (open) {
+            char *buf = request.prepare(pool, BUF_SIZE);
+            std::size_t const len = co_await stream.read_some(buf, request.free_space());
+            open = len > 0;
+            // Only a clean end of the stream completes the last expression; a failed
+            // connection has nobody to reply to
+            if (!open && stream.has_failed()) {
+                break;
+            }
+            request.commit(len, !open, receive_callback, emit);
+            open = co_await stream.drain() && open;
+        }
+        request.release(pool);
+    }
+
+    bool flush_output(int fd, Connection &c) {
+        Metrics::ThreadMetrics &metrics = Metrics::local();
+        OutputQueue &output = c.stream.pending();
+        std::size_t const before = output.size();
+        std::uint64_t const started = Metrics::now_ns();
+        bool const ok = output.flush(fd);
+        metrics.write.record(Metrics::now_ns() - started);
+        Metrics::add(metrics.bytes_sent, before - output.size());
+        if (output.size() != before) {
+            c.last_activity = now;
+        }
+        return ok;
+    }
+
+    void set_accepting(bool enable) {
+        accepting = enable;
+        ev.events = enable ? static_cast<std::uint32_t>(EPOLLIN) : 0;
+        ev.data.u64 = ConnectionTable<Connection>::key(listen_fd, 0);
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, listen_fd, &ev) < 0) {
+            perror("epoll_ctl");
+        }
+    }
+
+    // Listening stops at the connection limit and, under the Pause policy, while overloaded
+    void update_accepting() {
+        bool const enable = (options.max_connections == 0 || active < options.max_connections)
+                            && !(options.shed_policy == ShedPolicy::Pause && admission.is_overloaded());
+        if (enable != accepting) {
+            set_accepting(enable);
+        }
+    }
+
+    void open_connection(int conn_fd, StreamHandler const &stream_handler) {
+        if (options.shed_policy == ShedPolicy::Reject && admission.is_overloaded()) {
+            send(conn_fd, AdmissionControl::REJECT_MESSAGE, sizeof(AdmissionControl::REJECT_MESSAGE) - 1,
+                 MSG_DONTWAIT | MSG_NOSIGNAL);
+            close(conn_fd);
+            Metrics::add(Metrics::local().shed, 1);
+            return;
+        }
+        std::uint32_t const generation = conns.open(conn_fd);
+        std::uint64_t const key = ConnectionTable<Connection>::key(conn_fd, generation);
+        ev.events = EPOLLIN;
+        ev.data.u64 = key;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn_fd, &ev) < 0) {
+            perror("epoll_ctl");
+            conns.close(conn_fd);
+            close(conn_fd);
             return;
         }
-        set_nonblocking(listen_fd);
+        Connection &c = *conns.find(conn_fd, generation);
+        c.accepted_at = Metrics::now_ns();
+        c.counted = 0;
+        c.interest = EPOLLIN;
+        c.last_activity = now;
+        c.read_deadline = now + read_ticks;
+        c.timer.key = key;
+        if (std::uint64_t const deadline = deadline_of(c); deadline != UINT64_MAX) {
+            timers.schedule(c.timer, deadline);
+        }
+        Metrics::add(Metrics::local().accepted, 1);
+
+        ++active;
+        update_accepting();
+
+        // The handler runs up to its first read, which usually finds nothing yet
+        c.stream.open(conn_fd);
+        c.handler = stream_handler(c.stream);
+        c.handler.resume();
+        pending_output += c.stream.pending().size();
+        service(conn_fd, key, c, 0);
+    }
+
+    // Drains the backlog up to ACCEPT_BATCH connections, or until a limit stops accepting.
+    // accept4 hands the socket over already non-blocking, with no fcntl round trips.
+    void accept_connections(StreamHandler const &stream_handler) {
+        for (int n = 0; n < ACCEPT_BATCH && accepting; ++n) {
+            int const conn_fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (conn_fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                if ((errno == EMFILE || errno == ENFILE) && refuse_connection()) continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    perror("accept4");
+                }
+                return;
+            }
+            open_connection(conn_fd, stream_handler);
+        }
+    }
 
-        int opt = 1;
-        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    // Out of descriptors the pending connection stays in the backlog and the level-triggered
+    // listening socket fires again at once. The spare descriptor is given up to take the
+    // connection off the backlog and close it; false if even that fails.
+    bool refuse_connection() {
+        if (spare_fd >= 0) {
+            close(spare_fd);
+        }
+        int const conn_fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (conn_fd >= 0) {
+            close(conn_fd);
+            ++refused;
+            Metrics::add(Metrics::local().shed, 1);
+        }
+        spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
 
-        sockaddr_in addr{
-            .sin_family = AF_INET,
-            .sin_port = htons(port),
-            .sin_addr = {.s_addr = INADDR_ANY},
-            .sin_zero = {0},
-        };
+        std::uint64_t const now_ns = Metrics::now_ns();
+        if (now_ns - last_fd_warning >= FD_WARNING_INTERVAL_NS) {
+            last_fd_warning = now_ns;
+            std::cerr << "accept4: out of file descriptors, " << refused << " connections refused so far" << std::endl;
+        }
+        return conn_fd >= 0;
+    }
+
+    void close_connection(int fd, Connection &c, bool graceful) {
+        if (graceful) {
+            shutdown(fd, SHUT_WR);
+        }
+        Metrics::add(Metrics::local().closed, 1);
+        timers.cancel(c.timer);
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+        close(fd);
+        // An unfinished handler gets failing operations from here on and runs to its end
+        if (!c.handler.done()) {
+            c.stream.abort();
+        }
+        c.handler.reset();
+        pending_output -= c.stream.pending().size();
+        c.stream.release();
+        conns.close(fd);
 
-        if (bind(listen_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
-            perror("bind");
+        --active;
+        update_accepting();
+    }
+
+    void expire_timers() {
+        std::uint64_t expirations;
+        if (read(timer_fd, &expirations, sizeof(expirations)) < 0) {
             return;
         }
-        if (::listen(listen_fd, SOMAXCONN) < 0) {
-            perror("listen");
+        timers.advance(now, [this](TimerWheel::Node &timer) {
+            int const fd = ConnectionTable<Connection>::fd_of(timer.key);
+            Connection &c = *conns.find(fd, ConnectionTable<Connection>::generation_of(timer.key));
+            if (std::uint64_t const deadline = deadline_of(c); deadline > now) {
+                if (deadline != UINT64_MAX) {
+                    timers.schedule(timer, deadline);
+                }
+                return;
+            }
+            Metrics::add(Metrics::local().timeouts, 1);
+            close_connection(fd, c, false);
+        });
+    }
+
+    void update_interest(std::uint64_t key, Connection &c) {
+        std::uint32_t interest = 0;
+        if (c.stream.wants_read()) interest |= EPOLLIN;
+        if (!c.stream.pending().empty()) interest |= EPOLLOUT;
+        if (interest == c.interest) {
+            return;
+        }
+        c.interest = interest;
+        ev.events = interest;
+        ev.data.u64 = key;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, ConnectionTable<Connection>::fd_of(key), &ev) < 0) {
+            perror("epoll_ctl");
+        }
+    }
+
+    // Hands the readiness in events to the handler of the connection, sends what it has queued
+    // and closes the connection once the handler has finished and everything is sent
+    void service(int fd, std::uint64_t key, Connection &c, std::uint32_t events) {
+        std::size_t const queued = c.stream.pending().size();
+        bool failed = (events & EPOLLERR) != 0;
+
+        if (!failed && (events & (EPOLLIN | EPOLLHUP))) {
+            c.stream.on_readable();
+        }
+        if (!failed && !c.stream.pending().empty()) {
+            failed = !flush_output(fd, c);
+        }
+        if (!failed && c.stream.on_writable() && !c.stream.pending().empty()) {
+            failed = !flush_output(fd, c);
+        }
+        pending_output = pending_output - queued + c.stream.pending().size();
+
+        if (std::uint64_t const received = c.stream.bytes_received(); received != c.counted) {
+            Metrics::ThreadMetrics &metrics = Metrics::local();
+            if (c.counted == 0) {
+                metrics.first_byte.record(Metrics::now_ns() - c.accepted_at);
+            }
+            Metrics::add(metrics.bytes_received, received - c.counted);
+            c.counted = received;
+            c.last_activity = now;
+        }
+
+        if (failed || (c.handler.done() && c.stream.pending().empty())) {
+            if (failed) {
+                Metrics::add(Metrics::local().errors, 1);
+            }
+            close_connection(fd, c, !failed);
+            return;
+        }
+        update_interest(key, c);
+    }
+
+public:
+    explicit ConnectionsHandler(ServerOptions const &options)
+        : options(options), idle_ticks(ticks_of(options.idle_timeout_ms)), read_ticks(ticks_of(options.read_timeout_ms)),
+          epoll_fd(epoll_create1(0)), listen_fd(Listener::open(options, SOCK_NONBLOCK)),
+          timer_fd(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)),
+          spare_fd(open("/dev/null", O_RDONLY | O_CLOEXEC)), timers(now_ticks()),
+          admission(options), now(now_ticks()) {
+        if (listen_fd < 0) {
             return;
         }
 
         ev.events = EPOLLIN;
-        ev.data.fd = listen_fd;
+        ev.data.u64 = ConnectionTable<Connection>::key(listen_fd, 0);
         epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+
+        // The tick also wakes an overloaded loop up to notice when the load is gone
+        if (idle_ticks > 0 || read_ticks > 0 || admission.enabled()) {
+            itimerspec const tick{
+                .it_interval = {.tv_sec = 0, .tv_nsec = TICK_MS * 1000000},
+                .it_value = {.tv_sec = 0, .tv_nsec = TICK_MS * 1000000},
+            };
+            timerfd_settime(timer_fd, 0, &tick, nullptr);
+            ev.events = EPOLLIN;
+            ev.data.u64 = ConnectionTable<Connection>::key(timer_fd, 0);
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev);
+        }
     }
 
     void listen(ReceiveCallback const &receive_callback) {
-        std::cout << "listening on port " << port << std::endl;
+        listen(StreamHandler([this, &receive_callback](Stream &stream) {
+            return assemble(stream, receive_callback, pool);
+        }));
+    }
+
+    // Serves every connection with a coroutine from stream_handler
+    void listen(StreamHandler const &stream_handler) {
+        if (listen_fd < 0) {
+            return;
+        }
+        std::cout << "listening on " << Listener::name_of(options) << std::endl;
 
-        std::unordered_map<int, std::string> buffers;
         while (true) {
             int nf = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
             // std::cerr << "epoll_wait returned nf=" << nf << "\n";
             if (nf < 0) {
+                if (errno == EINTR) continue;
                 perror("epoll_wait");
                 break;
             }
+            std::uint64_t const started = Metrics::now_ns();
+            now = started / 1000000 / TICK_MS;
             for (int n = 0; n < nf; ++n) {
-                if (events[n].data.fd == listen_fd) {
-                    sockaddr_in cli_addr{};
-                    socklen_t cli_len = sizeof(cli_addr);
-                    int conn_fd = accept(listen_fd, reinterpret_cast<sockaddr *>(&cli_addr), &cli_len);
-                    if (conn_fd < 0) {
-                        continue;
-                    }
-                    set_nonblocking(conn_fd);
-                    ev.events = EPOLLIN;
-                    ev.data.fd = conn_fd;
-                    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn_fd, &ev) < 0) {
-                        perror("epoll_ctl");
-                    }
+                std::uint64_t const key = events[n].data.u64;
+                if (key == ConnectionTable<Connection>::key(listen_fd, 0)) {
+                    accept_connections(stream_handler);
+                } else if (key == ConnectionTable<Connection>::key(timer_fd, 0)) {
+                    expire_timers();
                 } else {
-                    int fd = events[n].data.fd;
-                    bool closed = false;
-                    while (true) {
-                        char buf[BUF_SIZE];
-                        long len = read(fd, buf, BUF_SIZE - 1);
-                        if (len > 0) {
-                            buffers[fd].append(buf, len);
-                        } else if (len == 0) {
-                            closed = true;
-                            break;
-                        } else {
-                            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                                break;
-                            }
-                            perror("read");
-                            closed = true;
-                            break;
-                        }
-                    }
-                    if (closed) {
-                        std::string const &data(buffers[fd]);
-
-                        std::string out = receive_callback(data);
-
-                        write(fd, out.c_str(), out.size());
-
-                        shutdown(fd, SHUT_WR);
-
-                        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
-                        close(fd);
-                        buffers.erase(fd);
+                    int const fd = ConnectionTable<Connection>::fd_of(key);
+                    Connection *conn = conns.find(fd, ConnectionTable<Connection>::generation_of(key));
+                    if (conn != nullptr) {
+                        service(fd, key, *conn, events[n].events);
                     }
                 }
             }
+
+            std::uint64_t const busy = Metrics::now_ns() - started;
+            Metrics::local().loop.record(busy);
+            if (admission.enabled()) {
+                admission.update(busy, pending_output);
+                update_accepting();
+            }
         }
     }
 
     ~ConnectionsHandler() {
+        if (spare_fd >= 0) {
+            close(spare_fd);
+        }
+        close(timer_fd);
         close(listen_fd);
         close(epoll_fd);
     }
@@ -0,0 +1,222 @@
+#ifndef EXPRESSIONSCANNER_H
+#define EXPRESSIONSCANNER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define EXPRESSION_SCANNER_X86 1
+#endif
+
+
+// Turns a request of whitespace-separated expressions into operand/operator tokens without
+// iostreams. The input is first classified into digit and whitespace bitmaps, 32 bytes
+// per AVX2 instruction when the CPU has it and through a lookup table otherwise.
+// Token and digit boundaries then come from bit scans, and digit runs are converted eight
+// at a time with SWAR arithmetic. Expressions outside the plain `[+-]digits (op [+-]digits)*`
+// grammar, or with operands longer than 18 digits, are reported without tokens so the caller
+// can evaluate them with Calculator::evaluate and keep its exact semantics.
+class ExpressionScanner {
+public:
+    struct Token {
+        long operand;
+        // The operator in front of the operand, '+' for the first one
+        char op;
+    };
+
+private:
+    static constexpr std::size_t MAX_DIGITS = 18;
+
+    enum : std::uint8_t {
+        DIGIT = 1,
+        SPACE = 2,
+        OPERATOR = 4
+    };
+
+    struct ClassTable {
+        std::uint8_t classes[256]{};
+
+        constexpr ClassTable() {
+            for (char c = '0'; c <= '9'; ++c) classes[static_cast<unsigned char>(c)] = DIGIT;
+            for (char c: {' ', '\t', '\n', '\v', '\f', '\r'}) classes[static_cast<unsigned char>(c)] = SPACE;
+            for (char c: {'+', '-', '*', '/'}) classes[static_cast<unsigned char>(c)] = OPERATOR;
+        }
+    };
+
+    static std::uint8_t class_of(char c) {
+        static constexpr ClassTable table{};
+        return table.classes[static_cast<unsigned char>(c)];
+    }
+
+    bool const use_avx2;
+    std::string_view data;
+    std::vector<std::uint64_t> digit_bits;
+    std::vector<std::uint64_t> space_bits;
+    std::vector<Token> tokens;
+
+    static void classify_scalar(char const *begin, std::size_t size, std::uint64_t *digit, std::uint64_t *space) {
+        for (std::size_t i = 0; i < size; ++i) {
+            std::uint8_t const cls = class_of(begin[i]);
+            digit[i / 64] |= static_cast<std::uint64_t>(cls & DIGIT) << (i % 64);
+            space[i / 64] |= static_cast<std::uint64_t>((cls & SPACE) >> 1) << (i % 64);
+        }
+    }
+
+#ifdef EXPRESSION_SCANNER_X86
+    __attribute__((target("avx2")))
+    static std::uint32_t digit_mask_avx2(__m256i chunk) {
+        __m256i const shifted = _mm256_sub_epi8(chunk, _mm256_set1_epi8('0'));
+        __m256i const is_digit = _mm256_cmpeq_epi8(_mm256_min_epu8(shifted, _mm256_set1_epi8(9)), shifted);
+        return static_cast<std::uint32_t>(_mm256_movemask_epi8(is_digit));
+    }
+
+    // ' ' and \t..\r, the characters std::isspace accepts in the C locale
+    __attribute__((target("avx2")))
+    static std::uint32_t space_mask_avx2(__m256i chunk) {
+        __m256i const shifted = _mm256_sub_epi8(chunk, _mm256_set1_epi8('\t'));
+        __m256i const is_control = _mm256_cmpeq_epi8(_mm256_min_epu8(shifted, _mm256_set1_epi8('\r' - '\t')), shifted);
+        __m256i const is_space = _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(' '));
+        return static_cast<std::uint32_t>(_mm256_movemask_epi8(_mm256_or_si256(is_control, is_space)));
+    }
+
+    __attribute__((target("avx2")))
+    static void classify_avx2(char const *begin, std::size_t size, std::uint64_t *digit, std::uint64_t *space) {
+        std::size_t i = 0;
+        for (; i + 64 <= size; i += 64) {
+            __m256i const low = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(begin + i));
+            __m256i const high = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(begin + i + 32));
+            digit[i / 64] = digit_mask_avx2(low) | static_cast<std::uint64_t>(digit_mask_avx2(high)) << 32;
+            space[i / 64] = space_mask_avx2(low) | static_cast<std::uint64_t>(space_mask_avx2(high)) << 32;
+        }
+        classify_scalar(begin + i, size - i, digit + i / 64, space + i / 64);
+    }
+#endif
+
+    // First position in [pos, end) whose bit equals want, or end
+    static std::size_t find_bit(std::vector<std::uint64_t> const &bits, std::size_t pos, std::size_t end, bool want) {
+        while (pos < end) {
+            std::uint64_t const word = want ? bits[pos / 64] : ~bits[pos / 64];
+            std::uint64_t const rest = word >> (pos % 64);
+            if (rest != 0) {
+                return std::min(end, pos + __builtin_ctzll(rest));
+            }
+            pos = (pos / 64 + 1) * 64;
+        }
+        return end;
+    }
+
+    // Converts the 8 ASCII digits of a little-endian word, the first digit in the lowest byte
+    static std::uint64_t parse_eight(std::uint64_t chunk) {
+        chunk = chunk * 10 + (chunk >> 8);
+        return ((chunk & 0x000000FF000000FF) * (100 + (1000000ull << 32))
+                + ((chunk >> 16) & 0x000000FF000000FF) * (1 + (10000ull << 32))) >> 32;
+    }
+
+    // Parses len <= 8 digits ending at end. The word is loaded so that it ends with the last
+    // digit, and the bytes in front of the first digit are masked to act as leading zeros.
+    std::uint64_t parse_short(std::size_t end, std::size_t len) const {
+        std::uint64_t chunk;
+        std::memcpy(&chunk, data.data() + end - 8, 8);
+        std::uint64_t const keep = len == 8 ? ~0ull : ~0ull << (8 * (8 - len));
+        return parse_eight((chunk & keep) - (0x3030303030303030ull & keep));
+    }
+
+    std::uint64_t parse_digits(std::size_t pos, std::size_t len) const {
+        std::size_t const end = pos + len;
+        if (len <= 8 && end >= 8) {
+            return parse_short(end, len);
+        }
+        if (len <= 16 && end >= 16) {
+            return parse_short(end - 8, len - 8) * 100000000 + parse_short(end, 8);
+        }
+        // Too close to the start of the input for a word load, or longer than two words
+        std::uint64_t value = 0;
+        for (std::size_t i = pos; i < end; ++i) {
+            value = value * 10 + static_cast<std::uint64_t>(data[i] - '0');
+        }
+        return value;
+    }
+
+    bool is_operator(std::size_t pos) const {
+        return class_of(data[pos]) & OPERATOR;
+    }
+
+    // Fills tokens for data[begin, end), returns false if the expression is not in the fast grammar
+    bool tokenize(std::size_t begin, std::size_t end) {
+        tokens.clear();
+        std::size_t pos = begin;
+        char op = '+';
+        while (true) {
+            bool negative = false;
+            if (pos < end && (data[pos] == '-' || data[pos] == '+')) {
+                negative = data[pos] == '-';
+                ++pos;
+            }
+            std::size_t const digits_end = find_bit(digit_bits, pos, end, false);
+            std::size_t const len = digits_end - pos;
+            if (len == 0 || len > MAX_DIGITS) {
+                return false;
+            }
+            auto const value = static_cast<long>(parse_digits(pos, len));
+            tokens.push_back({negative ? -value : value, op});
+            pos = digits_end;
+            if (pos == end) {
+                return true;
+            }
+            if (!is_operator(pos)) {
+                return false;
+            }
+            op = data[pos++];
+        }
+    }
+
+public:
+    explicit ExpressionScanner(bool allow_simd = true)
+#ifdef EXPRESSION_SCANNER_X86
+        : use_avx2(allow_simd && __builtin_cpu_supports("avx2")) {
+#else
+        : use_avx2(false) {
+        (void) allow_simd;
+#endif
+    }
+
+    bool simd() const {
+        return use_avx2;
+    }
+
+    // Calls on_expression(text, tokens, count) for every expression in order; count is 0 for
+    // expressions the caller has to evaluate from their text.
+    template<typename OnExpression>
+    void scan(std::string_view input, OnExpression &&on_expression) {
+        data = input;
+        std::size_t const words = (data.size() + 63) / 64;
+        digit_bits.assign(words, 0);
+        space_bits.assign(words, 0);
+#ifdef EXPRESSION_SCANNER_X86
+        if (use_avx2) {
+            classify_avx2(data.data(), data.size(), digit_bits.data(), space_bits.data());
+        } else
+#endif
+        {
+            classify_scalar(data.data(), data.size(), digit_bits.data(), space_bits.data());
+        }
+
+        std::size_t pos = find_bit(space_bits, 0, data.size(), false);
+        while (pos < data.size()) {
+            std::size_t const end = find_bit(space_bits, pos, data.size(), true);
+            std::string_view const text = data.substr(pos, end - pos);
+            if (tokenize(pos, end)) {
+                on_expression(text, tokens.data(), tokens.size());
+            } else {
+                on_expression(text, tokens.data(), std::size_t{0});
+            }
+            pos = find_bit(space_bits, end, data.size(), false);
+        }
+    }
+};
+
+#endif //EXPRESSIONSCANNER_H
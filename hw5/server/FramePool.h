@@ -0,0 +1,84 @@
+#ifndef FRAMEPOOL_H
+#define FRAMEPOOL_H
+
+#include <cstddef>
+#include <new>
+#include <utility>
+
+
+// Recycles coroutine frames through intrusive free lists, one per frame size. A server starts
+// the same coroutine for every connection, so in steady state a new connection reuses the frame
+// of a closed one instead of taking it from the heap. Each thread has its own pool.
+class FramePool {
+    static constexpr std::size_t SIZE_COUNT = 4;
+    static constexpr std::size_t MAX_CACHED_BYTES_PER_SIZE = 16 << 20;
+
+    struct FreeFrame {
+        FreeFrame *next;
+    };
+
+    struct FreeList {
+        std::size_t size = 0;
+        std::size_t count = 0;
+        FreeFrame *head = nullptr;
+    };
+
+    FreeList free_lists[SIZE_COUNT];
+
+    // The list of frames of this size, claiming an unused one; nullptr once all are taken
+    FreeList *list_of(std::size_t size) {
+        for (FreeList &list: free_lists) {
+            if (list.size == size) {
+                return &list;
+            }
+            if (list.size == 0) {
+                list.size = size;
+                return &list;
+            }
+        }
+        return nullptr;
+    }
+
+    FramePool() = default;
+
+public:
+    FramePool(FramePool const &) = delete;
+
+    FramePool &operator=(FramePool const &) = delete;
+
+    static FramePool &local() {
+        thread_local FramePool pool;
+        return pool;
+    }
+
+    void *allocate(std::size_t size) {
+        FreeList *list = list_of(size);
+        if (list == nullptr || list->head == nullptr) {
+            return ::operator new(size);
+        }
+        FreeFrame *frame = list->head;
+        list->head = frame->next;
+        --list->count;
+        return frame;
+    }
+
+    void release(void *frame, std::size_t size) {
+        FreeList *list = list_of(size);
+        if (list == nullptr || size < sizeof(FreeFrame) || (list->count + 1) * size > MAX_CACHED_BYTES_PER_SIZE) {
+            ::operator delete(frame);
+            return;
+        }
+        list->head = new(frame) FreeFrame{list->head};
+        ++list->count;
+    }
+
+    ~FramePool() {
+        for (FreeList &list: free_lists) {
+            while (list.head != nullptr) {
+                ::operator delete(std::exchange(list.head, list.head->next));
+            }
+        }
+    }
+};
+
+#endif //FRAMEPOOL_H
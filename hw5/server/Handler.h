@@ -0,0 +1,94 @@
+#ifndef HANDLER_H
+#define HANDLER_H
+
+#include <coroutine>
+#include <exception>
+#include <utility>
+
+#include "FramePool.h"
+
+
+// Coroutine serving one connection, owned by the event loop that drives it. It is created
+// suspended so the loop can store it before the first resume, and stays suspended at its end,
+// so the loop sees done() and destroys the frame itself. Frames come from FramePool.
+class Handler {
+public:
+    struct promise_type {
+        static void *operator new(std::size_t size) {
+            return FramePool::local().allocate(size);
+        }
+
+        static void operator delete(void *frame, std::size_t size) {
+            FramePool::local().release(frame, size);
+        }
+
+        Handler get_return_object() {
+            return Handler(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() noexcept {
+            return {};
+        }
+
+        std::suspend_always final_suspend() noexcept {
+            return {};
+        }
+
+        void return_void() {
+        }
+
+        // The loop has no one to report to, an escaping exception is a bug
+        void unhandled_exception() {
+            std::terminate();
+        }
+    };
+
+private:
+    std::coroutine_handle<promise_type> handle;
+
+    explicit Handler(std::coroutine_handle<promise_type> handle) : handle(handle) {
+    }
+
+public:
+    Handler() = default;
+
+    Handler(Handler &&other) noexcept : handle(std::exchange(other.handle, nullptr)) {
+    }
+
+    Handler &operator=(Handler &&other) noexcept {
+        if (this != &other) {
+            reset();
+            handle = std::exchange(other.handle, nullptr);
+        }
+        return *this;
+    }
+
+    Handler(Handler const &) = delete;
+
+    Handler &operator=(Handler const &) = delete;
+
+    ~Handler() {
+        reset();
+    }
+
+    explicit operator bool() const {
+        return static_cast<bool>(handle);
+    }
+
+    bool done() const {
+        return handle.done();
+    }
+
+    void resume() {
+        handle.resume();
+    }
+
+    void reset() {
+        if (handle) {
+            handle.destroy();
+            handle = nullptr;
+        }
+    }
+};
+
+#endif //HANDLER_H
@@ -0,0 +1,103 @@
+#ifndef LISTENER_H
+#define LISTENER_H
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "ServerOptions.h"
+
+
+// Creates the listening socket both connection handlers accept from: TCP on every interface,
+// or an AF_UNIX stream socket when ServerOptions::unix_path is set, which spares co-located
+// clients the loopback TCP/IP stack. Accepted TCP sockets inherit TCP_NODELAY from the
+// listener, so replies are not held back by Nagle and no per-connection setsockopt is needed.
+class Listener {
+    static bool bind_tcp(int fd, ServerOptions const &options) {
+        int opt = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+        if (options.defer_accept_s > 0) {
+            int const seconds = static_cast<int>(options.defer_accept_s);
+            setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &seconds, sizeof(seconds));
+        }
+
+        sockaddr_in addr{
+            .sin_family = AF_INET,
+            .sin_port = htons(options.port),
+            .sin_addr = {.s_addr = INADDR_ANY},
+            .sin_zero = {0},
+        };
+        return bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0;
+    }
+
+    // True if a server accepts connections on the socket file; a full backlog counts as one
+    static bool answers(sockaddr_un const &addr) {
+        int const probe = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (probe < 0) {
+            return false;
+        }
+        bool const live = connect(probe, reinterpret_cast<sockaddr const *>(&addr), sizeof(addr)) == 0
+                          || errno == EAGAIN || errno == EINPROGRESS;
+        close(probe);
+        return live;
+    }
+
+    // A socket file left by a previous run would make bind fail with EADDRINUSE, so it is
+    // removed; a socket a running server still answers on and any other file are left alone,
+    // and bind fails on them
+    static bool bind_unix(int fd, std::string const &path) {
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path)) {
+            errno = ENAMETOOLONG;
+            return false;
+        }
+        std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+        struct stat st{};
+        if (lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+            if (answers(addr)) {
+                errno = EADDRINUSE;
+                return false;
+            }
+            unlink(path.c_str());
+        }
+        return bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0;
+    }
+
+public:
+    // Returns the listening socket, or -1 after reporting the failure
+    static int open(ServerOptions const &options, int flags = 0) {
+        bool const local = !options.unix_path.empty();
+        int const fd = socket(local ? AF_UNIX : AF_INET, SOCK_STREAM | flags, 0);
+        if (fd < 0) {
+            perror("socket");
+            return -1;
+        }
+        if (!(local ? bind_unix(fd, options.unix_path) : bind_tcp(fd, options))) {
+            perror("bind");
+            close(fd);
+            return -1;
+        }
+        if (::listen(fd, options.backlog > 0 ? options.backlog : SOMAXCONN) < 0) {
+            perror("listen");
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    static std::string name_of(ServerOptions const &options) {
+        return options.unix_path.empty() ? "port " + std::to_string(options.port) : "unix:" + options.unix_path;
+    }
+};
+
+#endif //LISTENER_H
@@ -0,0 +1,214 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+
+// Server statistics. Every thread writes only its own ThreadMetrics with plain relaxed
+// stores, and a reader merges all of them on demand without taking any lock.
+class Metrics {
+public:
+    // Log-linear histogram of nanosecond values: 16 linear sub-buckets per power of two,
+    // so every recorded value is off by at most 1/16 of itself.
+    class Histogram {
+        static constexpr unsigned SUB_BITS = 4;
+        static constexpr unsigned SUB_COUNT = 1u << SUB_BITS;
+        static constexpr unsigned BUCKET_COUNT = (64 - SUB_BITS + 1) * SUB_COUNT;
+
+        std::atomic<std::uint64_t> buckets[BUCKET_COUNT]{};
+        std::atomic<std::uint64_t> sum{0};
+
+        static unsigned index_of(std::uint64_t value) {
+            if (value < SUB_COUNT) {
+                return static_cast<unsigned>(value);
+            }
+            unsigned const shift = 63 - __builtin_clzll(value) - SUB_BITS;
+            return (shift + 1) * SUB_COUNT + static_cast<unsigned>((value >> shift) & (SUB_COUNT - 1));
+        }
+
+        static std::uint64_t upper_bound_of(unsigned index) {
+            if (index < SUB_COUNT) {
+                return index;
+            }
+            unsigned const shift = index / SUB_COUNT - 1;
+            return ((SUB_COUNT + index % SUB_COUNT + 1ull) << shift) - 1;
+        }
+
+    public:
+        struct Snapshot {
+            std::vector<std::uint64_t> buckets = std::vector<std::uint64_t>(BUCKET_COUNT);
+            std::uint64_t count = 0;
+            std::uint64_t sum = 0;
+
+            void merge(Histogram const &histogram) {
+                for (unsigned i = 0; i < BUCKET_COUNT; ++i) {
+                    std::uint64_t const n = histogram.buckets[i].load(std::memory_order_relaxed);
+                    buckets[i] += n;
+                    count += n;
+                }
+                sum += histogram.sum.load(std::memory_order_relaxed);
+            }
+
+            std::uint64_t quantile(double q) const {
+                if (count == 0) {
+                    return 0;
+                }
+                auto const rank = std::min(count - 1, static_cast<std::uint64_t>(q * static_cast<double>(count)));
+                std::uint64_t seen = 0;
+                for (unsigned i = 0; i < BUCKET_COUNT; ++i) {
+                    seen += buckets[i];
+                    if (seen > rank) {
+                        return upper_bound_of(i);
+                    }
+                }
+                return 0;
+            }
+        };
+
+        // Must only be called by the owning thread
+        void record(std::uint64_t value) {
+            add(buckets[index_of(value)], 1);
+            add(sum, value);
+        }
+    };
+
+    struct ThreadMetrics {
+        std::atomic<std::uint64_t> accepted{0};
+        std::atomic<std::uint64_t> closed{0};
+        std::atomic<std::uint64_t> requests{0};
+        std::atomic<std::uint64_t> bytes_received{0};
+        std::atomic<std::uint64_t> bytes_sent{0};
+        std::atomic<std::uint64_t> errors{0};
+        std::atomic<std::uint64_t> timeouts{0};
+        std::atomic<std::uint64_t> shed{0};
+        Histogram first_byte;
+        Histogram evaluation;
+        Histogram write;
+        // Time the event loop spends handling one batch of events
+        Histogram loop;
+        ThreadMetrics *next = nullptr;
+    };
+
+    static std::uint64_t now_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Single-writer increment: a plain load and store instead of a locked read-modify-write
+    static void add(std::atomic<std::uint64_t> &counter, std::uint64_t n) {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    static ThreadMetrics &local() {
+        thread_local ThreadMetrics *metrics = register_thread();
+        return *metrics;
+    }
+
+    // Adds lines to the exposition, e.g. statistics of components owned by main
+    static void add_collector(std::function<void(std::ostream &)> collector) {
+        std::lock_guard lock(collectors_mutex());
+        collectors().push_back(std::move(collector));
+    }
+
+    // Prometheus text exposition format
+    static std::string exposition() {
+        std::uint64_t accepted = 0, closed = 0, requests = 0, bytes_received = 0, bytes_sent = 0;
+        std::uint64_t errors = 0, timeouts = 0, shed = 0;
+        Histogram::Snapshot first_byte, evaluation, write, loop;
+        for (ThreadMetrics *m = head().load(std::memory_order_acquire); m != nullptr; m = m->next) {
+            accepted += m->accepted.load(std::memory_order_relaxed);
+            closed += m->closed.load(std::memory_order_relaxed);
+            requests += m->requests.load(std::memory_order_relaxed);
+            bytes_received += m->bytes_received.load(std::memory_order_relaxed);
+            bytes_sent += m->bytes_sent.load(std::memory_order_relaxed);
+            errors += m->errors.load(std::memory_order_relaxed);
+            timeouts += m->timeouts.load(std::memory_order_relaxed);
+            shed += m->shed.load(std::memory_order_relaxed);
+            first_byte.merge(m->first_byte);
+            evaluation.merge(m->evaluation);
+            write.merge(m->write);
+            loop.merge(m->loop);
+        }
+
+        std::ostringstream oss;
+        auto counter = [&oss](char const *name, std::uint64_t value) {
+            oss << "# TYPE " << name << " counter\n" << name << ' ' << value << '\n';
+        };
+        oss << "# TYPE calc_uptime_seconds gauge\ncalc_uptime_seconds "
+                << static_cast<double>(now_ns() - start_ns()) / 1e9 << '\n';
+        counter("calc_connections_accepted_total", accepted);
+        counter("calc_connections_closed_total", closed);
+        oss << "# TYPE calc_connections_active gauge\ncalc_connections_active "
+                << (accepted >= closed ? accepted - closed : 0) << '\n';
+        counter("calc_requests_total", requests);
+        counter("calc_bytes_received_total", bytes_received);
+        counter("calc_bytes_sent_total", bytes_sent);
+        counter("calc_errors_total", errors);
+        counter("calc_timeouts_total", timeouts);
+        counter("calc_connections_shed_total", shed);
+
+        oss << "# TYPE calc_latency_seconds summary\n";
+        for (auto const &[stage, snapshot]: {
+                 std::pair<char const *, Histogram::Snapshot const &>{"first_byte", first_byte},
+                 {"evaluation", evaluation},
+                 {"write", write},
+                 {"loop", loop}
+             }) {
+            for (double const q: {0.5, 0.9, 0.99, 0.999, 1.0}) {
+                oss << "calc_latency_seconds{stage=\"" << stage << "\",quantile=\"" << q << "\"} "
+                        << static_cast<double>(snapshot.quantile(q)) / 1e9 << '\n';
+            }
+            oss << "calc_latency_seconds_sum{stage=\"" << stage << "\"} "
+                    << static_cast<double>(snapshot.sum) / 1e9 << '\n';
+            oss << "calc_latency_seconds_count{stage=\"" << stage << "\"} " << snapshot.count << '\n';
+        }
+
+        std::lock_guard lock(collectors_mutex());
+        for (auto const &collector: collectors()) {
+            collector(oss);
+        }
+        return oss.str();
+    }
+
+private:
+    static std::atomic<ThreadMetrics *> &head() {
+        static std::atomic<ThreadMetrics *> head{nullptr};
+        return head;
+    }
+
+    static std::uint64_t start_ns() {
+        static std::uint64_t const start = now_ns();
+        return start;
+    }
+
+    static std::vector<std::function<void(std::ostream &)>> &collectors() {
+        static std::vector<std::function<void(std::ostream &)>> collectors;
+        return collectors;
+    }
+
+    static std::mutex &collectors_mutex() {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    // Thread metrics live until the process exits, so readers never see a dangling entry
+    static ThreadMetrics *register_thread() {
+        start_ns();
+        auto *metrics = new ThreadMetrics;
+        metrics->next = head().load(std::memory_order_relaxed);
+        while (!head().compare_exchange_weak(metrics->next, metrics, std::memory_order_release,
+                                             std::memory_order_relaxed)) {
+        }
+        return metrics;
+    }
+};
+
+#endif //METRICS_H
@@ -0,0 +1,151 @@
+#ifndef METRICSREPORTER_H
+#define METRICSREPORTER_H
+
+#include <iostream>
+#include <string>
+#include <thread>
+#include <csignal>
+#include <cstdint>
+
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "Metrics.h"
+
+
+// Publishes Metrics::exposition() from a background thread, so the event loop never formats
+// anything: SIGUSR1 dumps it to stderr, and every connection to the admin port (if one is
+// given) receives it as a plain HTTP response that curl or a Prometheus scraper understands.
+// Must be created before any other thread, since SIGUSR1 stays blocked in all of them.
+class MetricsReporter {
+    int const admin_fd;
+    int const signal_fd;
+    int const stop_fd;
+    std::thread thread;
+
+    static int open_admin_socket(int port) {
+        if (port <= 0) {
+            return -1;
+        }
+        int const fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            perror("socket");
+            return -1;
+        }
+        int opt = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+        sockaddr_in addr{
+            .sin_family = AF_INET,
+            .sin_port = htons(port),
+            .sin_addr = {.s_addr = INADDR_ANY},
+            .sin_zero = {0},
+        };
+        if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0 || ::listen(fd, 16) < 0) {
+            perror("admin socket");
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    static int open_signal_fd() {
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGUSR1);
+        pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+        return signalfd(-1, &mask, SFD_CLOEXEC);
+    }
+
+    static void write_all(int fd, std::string const &data) {
+        std::size_t done = 0;
+        while (done < data.size()) {
+            long const written = write(fd, data.data() + done, data.size() - done);
+            if (written <= 0) {
+                if (written < 0 && errno == EINTR) continue;
+                return;
+            }
+            done += written;
+        }
+    }
+
+    void serve_admin_connection() const {
+        int const fd = accept4(admin_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+        // The request itself does not matter, it is only drained so closing does not reset the connection
+        timeval timeout{.tv_sec = 1, .tv_usec = 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        char buf[4096];
+        [[maybe_unused]] long const ignored = read(fd, buf, sizeof(buf));
+
+        std::string const body = Metrics::exposition();
+        write_all(fd, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+                      + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body);
+        shutdown(fd, SHUT_WR);
+        close(fd);
+    }
+
+    void run() const {
+        pollfd fds[3] = {
+            {.fd = stop_fd, .events = POLLIN, .revents = 0},
+            {.fd = signal_fd, .events = POLLIN, .revents = 0},
+            {.fd = admin_fd, .events = POLLIN, .revents = 0},
+        };
+        while (true) {
+            if (poll(fds, admin_fd >= 0 ? 3 : 2, -1) < 0) {
+                if (errno == EINTR) continue;
+                perror("poll");
+                return;
+            }
+            if (fds[0].revents) {
+                return;
+            }
+            if (fds[1].revents) {
+                signalfd_siginfo info{};
+                if (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+                    std::cerr << Metrics::exposition() << std::flush;
+                }
+            }
+            if (fds[2].revents) {
+                serve_admin_connection();
+            }
+        }
+    }
+
+public:
+    explicit MetricsReporter(int const admin_port)
+        : admin_fd(open_admin_socket(admin_port)), signal_fd(open_signal_fd()),
+          stop_fd(eventfd(0, EFD_CLOEXEC)) {
+        if (signal_fd < 0 || stop_fd < 0) {
+            perror("metrics reporter");
+            return;
+        }
+        if (admin_fd >= 0) {
+            std::cout << "metrics on port " << admin_port << std::endl;
+        }
+        thread = std::thread(&MetricsReporter::run, this);
+    }
+
+    MetricsReporter(MetricsReporter const &) = delete;
+
+    MetricsReporter &operator=(MetricsReporter const &) = delete;
+
+    ~MetricsReporter() {
+        if (thread.joinable()) {
+            std::uint64_t const one = 1;
+            [[maybe_unused]] long const ignored = write(stop_fd, &one, sizeof(one));
+            thread.join();
+        }
+        if (admin_fd >= 0) close(admin_fd);
+        if (signal_fd >= 0) close(signal_fd);
+        if (stop_fd >= 0) close(stop_fd);
+    }
+};
+
+#endif //METRICSREPORTER_H
@@ -0,0 +1,78 @@
+#ifndef OUTPUTQUEUE_H
+#define OUTPUTQUEUE_H
+
+#include <algorithm>
+#include <cerrno>
+#include <deque>
+#include <string>
+
+#include <sys/uio.h>
+
+
+// Pending response bytes of a single connection. Chunks are sent with writev,
+// so small pieces queued one after another leave in a single syscall.
+class OutputQueue {
+    static constexpr int MAX_IOV = 64;
+
+    std::deque<std::string> chunks;
+    std::size_t head_offset = 0;
+    std::size_t pending = 0;
+
+    void consume(std::size_t n) {
+        pending -= n;
+        while (n > 0) {
+            std::size_t const left = chunks.front().size() - head_offset;
+            if (n < left) {
+                head_offset += n;
+                return;
+            }
+            n -= left;
+            chunks.pop_front();
+            head_offset = 0;
+        }
+    }
+
+public:
+    void push(std::string chunk) {
+        if (chunk.empty()) return;
+        pending += chunk.size();
+        chunks.push_back(std::move(chunk));
+    }
+
+    void clear() {
+        chunks.clear();
+        head_offset = 0;
+        pending = 0;
+    }
+
+    std::size_t size() const {
+        return pending;
+    }
+
+    bool empty() const {
+        return pending == 0;
+    }
+
+    // Writes as much as the socket accepts. Returns false on a fatal socket error;
+    // otherwise the caller checks empty() to learn whether EPOLLOUT is still needed.
+    bool flush(int fd) {
+        while (pending > 0) {
+            iovec iov[MAX_IOV];
+            int const cnt = static_cast<int>(std::min<std::size_t>(chunks.size(), MAX_IOV));
+            for (int i = 0; i < cnt; ++i) {
+                std::size_t const off = i == 0 ? head_offset : 0;
+                iov[i].iov_base = chunks[i].data() + off;
+                iov[i].iov_len = chunks[i].size() - off;
+            }
+            long written = writev(fd, iov, cnt);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+            consume(static_cast<std::size_t>(written));
+        }
+        return true;
+    }
+};
+
+#endif //OUTPUTQUEUE_H
@@ -0,0 +1,116 @@
+#ifndef REQUESTASSEMBLER_H
+#define REQUESTASSEMBLER_H
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+#include "BinaryProtocol.h"
+#include "BufferPool.h"
+
+
+enum class Protocol {
+    Unknown,
+    Text,
+    Binary
+};
+
+
+// Collects the incoming byte stream of a connection and hands every complete unit
+// (whitespace-terminated expressions or whole binary frames) to the callback, so results
+// are produced while the rest of the request is still arriving. Only the incomplete
+// tail is kept, in a buffer taken from the pool. The first byte selects the protocol.
+class RequestAssembler {
+    static constexpr std::size_t INITIAL_CAPACITY = 4096;
+
+    BufferPool::Buffer buffer;
+    std::size_t size = 0;
+    Protocol protocol = Protocol::Unknown;
+
+    // Emit receives the reply pieces in order. Every text reply ends with a space, so a client
+    // streaming requests can tell a complete result from one still arriving
+    template<typename Callback, typename Emit>
+    std::size_t process(std::string_view data, bool eof, Callback const &receive_callback, Emit &&emit) {
+        std::size_t skipped = 0;
+        if (protocol == Protocol::Unknown && !data.empty()) {
+            protocol = static_cast<unsigned char>(data.front()) == BinaryProtocol::MAGIC
+                           ? Protocol::Binary
+                           : Protocol::Text;
+            if (protocol == Protocol::Binary) {
+                data.remove_prefix(skipped = 1);
+            }
+        }
+
+        std::size_t split;
+        if (protocol == Protocol::Binary) {
+            split = BinaryProtocol::complete_prefix(data);
+        } else {
+            split = eof ? data.size() : data.find_last_of(" \t\r\n");
+            if (split != std::string_view::npos && !eof) ++split;
+        }
+        if (split == std::string_view::npos || split == 0) {
+            return skipped;
+        }
+
+        std::string out = receive_callback(data.substr(0, split), protocol);
+        if (!out.empty()) {
+            if (protocol == Protocol::Text) {
+                out.push_back(' ');
+            }
+            emit(std::move(out));
+        }
+        return skipped + split;
+    }
+
+public:
+    // Returns space for at least min_free more bytes after the pending input
+    char *prepare(BufferPool &pool, std::size_t min_free) {
+        if (buffer.capacity - size < min_free) {
+            BufferPool::Buffer const grown = pool.acquire(std::max(size + min_free, INITIAL_CAPACITY));
+            if (size > 0) {
+                std::memcpy(grown.data, buffer.data, size);
+            }
+            pool.release(buffer);
+            buffer = grown;
+        }
+        return buffer.data + size;
+    }
+
+    std::size_t free_space() const {
+        return buffer.capacity - size;
+    }
+
+    // Processes n bytes written into the space returned by prepare()
+    template<typename Callback, typename Emit>
+    void commit(std::size_t n, bool eof, Callback const &receive_callback, Emit &&emit) {
+        size += n;
+        std::size_t const done = process({buffer.data, size}, eof, receive_callback, emit);
+        size -= done;
+        if (done > 0 && size > 0) {
+            std::memmove(buffer.data, buffer.data + done, size);
+        }
+    }
+
+    // Complete expressions are processed straight from data when nothing is pending
+    template<typename Callback, typename Emit>
+    void feed(BufferPool &pool, std::string_view data, bool eof, Callback const &receive_callback, Emit &&emit) {
+        if (size == 0) {
+            data.remove_prefix(process(data, eof, receive_callback, emit));
+            if (data.empty()) {
+                return;
+            }
+        }
+        std::memcpy(prepare(pool, data.size()), data.data(), data.size());
+        commit(data.size(), eof, receive_callback, emit);
+    }
+
+    void release(BufferPool &pool) {
+        pool.release(buffer);
+        buffer = {};
+        size = 0;
+        protocol = Protocol::Unknown;
+    }
+};
+
+#endif //REQUESTASSEMBLER_H
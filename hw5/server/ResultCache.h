@@ -0,0 +1,153 @@
+#ifndef RESULTCACHE_H
+#define RESULTCACHE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+
+// Bounded cache of expression results. Keys are spread over independently locked shards;
+// inside a shard the table is set-associative with one cache line per entry and CLOCK
+// (second chance) replacement within a set, so a lookup touches a couple of cache lines.
+// Keys longer than MAX_KEY_SIZE are not cached.
+class ResultCache {
+public:
+    static constexpr std::size_t MAX_KEY_SIZE = 46;
+
+    struct Stats {
+        std::uint64_t hits = 0;
+        std::uint64_t misses = 0;
+        std::uint64_t evictions = 0;
+        std::size_t entries = 0;
+        std::size_t capacity = 0;
+    };
+
+private:
+    static constexpr std::size_t SHARD_COUNT = 16;
+    static constexpr std::size_t WAYS = 4;
+
+    struct alignas(64) Slot {
+        std::uint64_t hash = 0;
+        long value = 0;
+        std::uint8_t size = 0;
+        bool referenced = false;
+        char key[MAX_KEY_SIZE]{};
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        std::vector<Slot> slots;
+        std::vector<std::uint8_t> hands;
+        std::size_t entries = 0;
+        std::uint64_t hits = 0;
+        std::uint64_t misses = 0;
+        std::uint64_t evictions = 0;
+    };
+
+    std::size_t const sets_per_shard;
+    Shard shards[SHARD_COUNT];
+
+    static std::uint64_t hash_of(std::string_view key) {
+        std::uint64_t const hash = std::hash<std::string_view>{}(key);
+        return hash == 0 ? 1 : hash;
+    }
+
+    Shard &shard_of(std::uint64_t hash) {
+        return shards[hash % SHARD_COUNT];
+    }
+
+    std::size_t set_of(std::uint64_t hash) const {
+        return hash / SHARD_COUNT % sets_per_shard;
+    }
+
+    static bool matches(Slot const &slot, std::uint64_t hash, std::string_view key) {
+        return slot.hash == hash && slot.size == key.size() && std::memcmp(slot.key, key.data(), key.size()) == 0;
+    }
+
+public:
+    explicit ResultCache(std::size_t capacity_bytes)
+        : sets_per_shard(std::max<std::size_t>(1, capacity_bytes / sizeof(Slot) / WAYS / SHARD_COUNT)) {
+        for (Shard &shard: shards) {
+            shard.slots.resize(sets_per_shard * WAYS);
+            shard.hands.resize(sets_per_shard);
+        }
+    }
+
+    ResultCache(ResultCache const &) = delete;
+
+    ResultCache &operator=(ResultCache const &) = delete;
+
+    // Keys too long to be stored are not looked up, nor counted as misses
+    std::optional<long> find(std::string_view key) {
+        if (key.size() > MAX_KEY_SIZE) {
+            return std::nullopt;
+        }
+        std::uint64_t const hash = hash_of(key);
+        Shard &shard = shard_of(hash);
+        std::lock_guard lock(shard.mutex);
+        Slot *set = &shard.slots[set_of(hash) * WAYS];
+        for (std::size_t way = 0; way < WAYS; ++way) {
+            if (matches(set[way], hash, key)) {
+                ++shard.hits;
+                set[way].referenced = true;
+                return set[way].value;
+            }
+        }
+        ++shard.misses;
+        return std::nullopt;
+    }
+
+    void insert(std::string_view key, long value) {
+        if (key.size() > MAX_KEY_SIZE) {
+            return;
+        }
+        std::uint64_t const hash = hash_of(key);
+        Shard &shard = shard_of(hash);
+        std::lock_guard lock(shard.mutex);
+        std::size_t const set_index = set_of(hash);
+        Slot *set = &shard.slots[set_index * WAYS];
+        for (std::size_t way = 0; way < WAYS; ++way) {
+            if (matches(set[way], hash, key)) {
+                return;
+            }
+        }
+
+        std::uint8_t &hand = shard.hands[set_index];
+        while (set[hand].hash != 0 && set[hand].referenced) {
+            set[hand].referenced = false;
+            hand = (hand + 1) % WAYS;
+        }
+        Slot &victim = set[hand];
+        hand = (hand + 1) % WAYS;
+        if (victim.hash != 0) {
+            ++shard.evictions;
+        } else {
+            ++shard.entries;
+        }
+        victim.hash = hash;
+        victim.value = value;
+        victim.size = static_cast<std::uint8_t>(key.size());
+        victim.referenced = false;
+        std::memcpy(victim.key, key.data(), key.size());
+    }
+
+    Stats stats() {
+        Stats total;
+        for (Shard &shard: shards) {
+            std::lock_guard lock(shard.mutex);
+            total.hits += shard.hits;
+            total.misses += shard.misses;
+            total.evictions += shard.evictions;
+            total.entries += shard.entries;
+            total.capacity += shard.slots.size();
+        }
+        return total;
+    }
+};
+
+#endif //RESULTCACHE_H
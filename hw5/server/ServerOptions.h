@@ -0,0 +1,39 @@
+#ifndef SERVEROPTIONS_H
+#define SERVEROPTIONS_H
+
+#include <cstddef>
+#include <string>
+
+
+// What the server does with new connections while it is overloaded
+enum class ShedPolicy {
+    // Leaves them in the listen backlog
+    Pause,
+    // Accepts them and answers with a short error right away
+    Reject
+};
+
+// Settings shared by both connection handlers. Zero disables a timeout or a limit.
+struct ServerOptions {
+    int port = 0;
+    // Listens on this AF_UNIX socket path instead of the TCP port when not empty
+    std::string unix_path;
+    // Length of the listen queue, SOMAXCONN when zero
+    int backlog = 0;
+    // TCP_DEFER_ACCEPT: a connection is only accepted once its first data arrives or after
+    // this many seconds
+    unsigned defer_accept_s = 0;
+    // Closes a connection that has neither received nor sent anything for this long
+    unsigned idle_timeout_ms = 60000;
+    // Closes a connection that has not finished sending its request this long after accept
+    unsigned read_timeout_ms = 0;
+    // Stops accepting while this many connections are open
+    std::size_t max_connections = 0;
+    // Overload thresholds: smoothed time the event loop spends per iteration, and reply bytes
+    // waiting to be sent over all connections
+    unsigned max_loop_lag_ms = 0;
+    std::size_t max_pending_output = 0;
+    ShedPolicy shed_policy = ShedPolicy::Pause;
+};
+
+#endif //SERVEROPTIONS_H
@@ -0,0 +1,212 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <coroutine>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <utility>
+
+#include <unistd.h>
+
+#include "OutputQueue.h"
+
+
+// The connection as a Handler coroutine sees it. read_some() completes right away while the
+// socket has data and otherwise suspends the handler until the event loop reports the socket
+// readable; write() queues a reply and suspends only while more than MAX_BACKLOG bytes are
+// waiting to be sent, so a peer that does not read throttles its handler. Once the connection
+// fails or is closed by the server, reads return nothing and writes return false without
+// suspending, so the handler runs to its end.
+class Stream {
+public:
+    static constexpr std::size_t MAX_BACKLOG = 1 << 20;
+
+private:
+    int fd = -1;
+    OutputQueue output;
+    std::coroutine_handle<> waiting;
+    // Where the pending read goes, and how much the last one got
+    char *target = nullptr;
+    std::size_t target_size = 0;
+    std::size_t length = 0;
+    std::uint64_t received = 0;
+    bool reading = false;
+    bool eof = false;
+    bool failed = false;
+
+    // Reads into the target; false if the socket has nothing yet
+    bool receive() {
+        length = 0;
+        if (eof || failed) {
+            return true;
+        }
+        while (true) {
+            long const len = read(fd, target, target_size);
+            if (len > 0) {
+                length = static_cast<std::size_t>(len);
+                received += length;
+                return true;
+            }
+            if (len == 0) {
+                eof = true;
+                return true;
+            }
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return false;
+            }
+            perror("read");
+            failed = true;
+            return true;
+        }
+    }
+
+    bool congested() const {
+        return !failed && output.size() > MAX_BACKLOG;
+    }
+
+    void resume() {
+        reading = false;
+        std::exchange(waiting, nullptr).resume();
+    }
+
+public:
+    class ReadAwaiter {
+        Stream &stream;
+        char *data;
+        std::size_t size;
+
+    public:
+        ReadAwaiter(Stream &stream, char *data, std::size_t size) : stream(stream), data(data), size(size) {
+        }
+
+        bool await_ready() {
+            stream.target = data;
+            stream.target_size = size;
+            return stream.receive();
+        }
+
+        void await_suspend(std::coroutine_handle<> handle) {
+            stream.waiting = handle;
+            stream.reading = true;
+        }
+
+        // 0 at the end of the stream
+        std::size_t await_resume() const {
+            return stream.length;
+        }
+    };
+
+    class WriteAwaiter {
+        Stream &stream;
+
+    public:
+        explicit WriteAwaiter(Stream &stream) : stream(stream) {
+        }
+
+        bool await_ready() const {
+            return !stream.congested();
+        }
+
+        void await_suspend(std::coroutine_handle<> handle) {
+            stream.waiting = handle;
+        }
+
+        // false once the connection has failed
+        bool await_resume() const {
+            return !stream.failed;
+        }
+    };
+
+    Stream() = default;
+
+    Stream(Stream const &) = delete;
+
+    Stream &operator=(Stream const &) = delete;
+
+    // Reads straight into the caller's memory
+    ReadAwaiter read_some(char *data, std::size_t size) {
+        return {*this, data, size};
+    }
+
+    WriteAwaiter write(std::string data) {
+        queue(std::move(data));
+        return drain();
+    }
+
+    // Queues a reply without suspending, for code that cannot co_await
+    void queue(std::string data) {
+        if (!failed) {
+            output.push(std::move(data));
+        }
+    }
+
+    // Suspends while more than MAX_BACKLOG bytes wait to be sent; false once the connection has failed
+    WriteAwaiter drain() {
+        return WriteAwaiter(*this);
+    }
+
+    // Event loop side
+
+    void open(int socket) {
+        fd = socket;
+        received = 0;
+        eof = failed = reading = false;
+    }
+
+    void release() {
+        output.clear();
+        waiting = nullptr;
+        fd = -1;
+    }
+
+    OutputQueue &pending() {
+        return output;
+    }
+
+    bool wants_read() const {
+        return reading;
+    }
+
+    bool at_eof() const {
+        return eof;
+    }
+
+    // The connection was reset, a read failed or the server aborted it
+    bool has_failed() const {
+        return failed;
+    }
+
+    std::uint64_t bytes_received() const {
+        return received;
+    }
+
+    // Completes a suspended read once the socket has data
+    void on_readable() {
+        if (reading && receive()) {
+            resume();
+        }
+    }
+
+    // Resumes a suspended write once the backlog has shrunk; true if the handler ran
+    bool on_writable() {
+        if (waiting && !reading && !congested()) {
+            resume();
+            return true;
+        }
+        return false;
+    }
+
+    // Fails every pending and later operation, so the handler can finish
+    void abort() {
+        failed = true;
+        length = 0;
+        if (waiting) {
+            resume();
+        }
+    }
+};
+
+#endif //STREAM_H
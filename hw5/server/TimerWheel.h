@@ -0,0 +1,135 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+
+// Hierarchical timing wheel: LEVELS wheels of SLOTS slots, each level SLOTS times coarser than
+// the previous one. Timers are intrusive nodes, so scheduling and cancelling are O(1) pointer
+// updates with no allocation; a timer far in the future is cascaded to a finer level at most
+// LEVELS - 1 times before it fires. Time is measured in ticks, the caller picks their length.
+class TimerWheel {
+    static constexpr unsigned LEVEL_BITS = 6;
+    static constexpr unsigned SLOTS = 1u << LEVEL_BITS;
+    static constexpr unsigned LEVELS = 4;
+    static constexpr std::uint64_t MAX_DELTA = (1ull << (LEVEL_BITS * LEVELS)) - 1;
+
+public:
+    struct Node {
+        Node *prev = nullptr;
+        Node *next = nullptr;
+        std::uint64_t expires = 0;
+        // Identifies the owner of the timer for the expiry callback
+        std::uint64_t key = 0;
+
+        bool scheduled() const {
+            return prev != nullptr;
+        }
+    };
+
+private:
+    Node slots[LEVELS][SLOTS];
+    std::uint64_t current;
+    std::size_t count = 0;
+
+    static void link(Node &head, Node &node) {
+        node.prev = head.prev;
+        node.next = &head;
+        head.prev->next = &node;
+        head.prev = &node;
+    }
+
+    static void unlink(Node &node) {
+        node.prev->next = node.next;
+        node.next->prev = node.prev;
+        node.prev = node.next = nullptr;
+    }
+
+    void place(Node &node) {
+        if (node.expires <= current) {
+            link(slots[0][(current + 1) & (SLOTS - 1)], node);
+            return;
+        }
+        std::uint64_t const delta = node.expires - current;
+        unsigned level = 0;
+        while (level + 1 < LEVELS && delta >= 1ull << (LEVEL_BITS * (level + 1))) {
+            ++level;
+        }
+        link(slots[level][(node.expires >> (LEVEL_BITS * level)) & (SLOTS - 1)], node);
+    }
+
+    // Moves the slot into a local list first, so callbacks may reschedule the timers they get
+    template<typename Visit>
+    static void drain(Node &head, Visit &&visit) {
+        if (head.next == &head) {
+            return;
+        }
+        Node pending;
+        pending.next = head.next;
+        pending.prev = head.prev;
+        pending.next->prev = pending.prev->next = &pending;
+        head.next = head.prev = &head;
+        while (pending.next != &pending) {
+            Node &node = *pending.next;
+            unlink(node);
+            visit(node);
+        }
+    }
+
+public:
+    explicit TimerWheel(std::uint64_t now) : current(now) {
+        for (auto &level: slots) {
+            for (Node &head: level) {
+                head.prev = head.next = &head;
+            }
+        }
+    }
+
+    TimerWheel(TimerWheel const &) = delete;
+
+    TimerWheel &operator=(TimerWheel const &) = delete;
+
+    void schedule(Node &node, std::uint64_t expires) {
+        if (node.scheduled()) {
+            unlink(node);
+        } else {
+            ++count;
+        }
+        node.expires = std::min(expires, current + MAX_DELTA);
+        place(node);
+    }
+
+    void cancel(Node &node) {
+        if (node.scheduled()) {
+            unlink(node);
+            --count;
+        }
+    }
+
+    // Fires every timer that expires at or before now, in tick order
+    template<typename OnExpire>
+    void advance(std::uint64_t now, OnExpire &&on_expire) {
+        while (current < now) {
+            if (count == 0) {
+                current = now;
+                return;
+            }
+            ++current;
+            for (unsigned level = 1; level < LEVELS; ++level) {
+                if ((current & ((1ull << (LEVEL_BITS * level)) - 1)) != 0) {
+                    break;
+                }
+                drain(slots[level][(current >> (LEVEL_BITS * level)) & (SLOTS - 1)],
+                      [this](Node &node) { place(node); });
+            }
+            drain(slots[0][current & (SLOTS - 1)], [this, &on_expire](Node &node) {
+                --count;
+                on_expire(node);
+            });
+        }
+    }
+};
+
+#endif //TIMERWHEEL_H
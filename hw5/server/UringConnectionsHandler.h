@@ -0,0 +1,669 @@
+#ifndef URINGCONNECTIONSHANDLER_H
+#define URINGCONNECTIONSHANDLER_H
+
+#include <iostream>
+#include <functional>
+#include <string_view>
+#include <vector>
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "AdmissionControl.h"
+#include "BufferPool.h"
+#include "ConnectionTable.h"
+#include "Listener.h"
+#include "Metrics.h"
+#include "RequestAssembler.h"
+#include "ServerOptions.h"
+#include "Stream.h"
+#include "TimerWheel.h"
+
+
+// io_uring flavour of ConnectionsHandler built on raw syscalls: one multishot accept,
+// one multishot recv per connection reading into a provided buffer ring, and the reply
+// leaves as a send linked to the close, so a request costs about one io_uring_enter.
+// A client that keeps its connection open gets its replies as they are produced; once more
+// than Stream::MAX_BACKLOG bytes of them wait for it, its recv is cancelled until a send
+// brings the backlog back under the limit, as the epoll backend stops reading such a client.
+class UringConnectionsHandler {
+public:
+    using ReceiveCallback = std::function<std::string(std::string_view, Protocol)>;
+
+private:
+    static constexpr unsigned RING_ENTRIES = 4096;
+    static constexpr unsigned BUF_COUNT = 4096;
+    static constexpr unsigned BUF_SIZE = 4096;
+    static constexpr unsigned short BUF_GROUP = 0;
+    static constexpr std::uint64_t TICK_MS = 100;
+
+    // user_data layout: generation << 32 | fd << 8 | op
+    enum Op : std::uint64_t {
+        ACCEPT,
+        RECV,
+        SEND,
+        CLOSE,
+        PROVIDE,
+        TIMER,
+        CANCEL
+    };
+
+    struct Connection {
+        RequestAssembler request;
+        std::string output;
+        std::string in_flight;
+        TimerWheel::Node timer;
+        std::uint64_t last_activity = 0;
+        std::uint64_t read_deadline = 0;
+        std::uint64_t accepted_at = 0;
+        std::uint64_t send_started = 0;
+        std::uint32_t generation = 0;
+        bool sending = false;
+        // A multishot recv is outstanding, and a cancel for it has been submitted
+        bool recv_armed = false;
+        bool recv_cancelled = false;
+        bool read_closed = false;
+        bool closing = false;
+        bool awaiting_first_byte = false;
+    };
+
+    ServerOptions const options;
+    std::uint64_t const idle_ticks;
+    std::uint64_t const read_ticks;
+
+    int const listen_fd;
+    int const timer_fd;
+    int ring_fd = -1;
+
+    void *sq_ptr = MAP_FAILED, *cq_ptr = MAP_FAILED;
+    std::size_t sq_len = 0, cq_len = 0, sqes_len = 0;
+    unsigned *sq_head = nullptr, *sq_tail = nullptr, *sq_mask = nullptr;
+    unsigned sq_entries = 0, sq_local_tail = 0, sq_submitted = 0;
+    io_uring_sqe *sqes = static_cast<io_uring_sqe *>(MAP_FAILED);
+    unsigned *cq_head = nullptr, *cq_tail = nullptr, *cq_mask = nullptr;
+    io_uring_cqe *cqes = nullptr;
+
+    io_uring_buf_ring *buf_ring = static_cast<io_uring_buf_ring *>(MAP_FAILED);
+    std::vector<char> buffers;
+    unsigned short buf_tail = 0;
+    bool use_buf_ring = false;
+
+    ConnectionTable<Connection> conns;
+    BufferPool pool;
+    TimerWheel timers;
+    AdmissionControl admission;
+    std::uint64_t timer_expirations = 0;
+    // Tick of the current batch of completions
+    std::uint64_t now;
+    std::size_t active = 0;
+    std::size_t pending_output = 0;
+    bool accepting = true;
+    bool accept_armed = false;
+
+    static std::uint64_t now_ticks() {
+        return Metrics::now_ns() / 1000000 / TICK_MS;
+    }
+
+    static std::uint64_t ticks_of(unsigned ms) {
+        return (ms + TICK_MS - 1) / TICK_MS;
+    }
+
+    std::uint64_t deadline_of(Connection const &c) const {
+        std::uint64_t deadline = UINT64_MAX;
+        if (idle_ticks > 0) {
+            deadline = c.last_activity + idle_ticks;
+        }
+        if (read_ticks > 0 && !c.read_closed) {
+            deadline = std::min(deadline, c.read_deadline);
+        }
+        return deadline;
+    }
+
+    static int uring_setup(unsigned entries, io_uring_params *params) {
+        return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+    }
+
+    static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+        return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+    }
+
+    static int uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+        return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+    }
+
+    bool setup_ring() {
+        io_uring_params params{};
+        params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+        params.cq_entries = RING_ENTRIES * 4;
+        ring_fd = uring_setup(RING_ENTRIES, &params);
+        if (ring_fd < 0 && errno == EINVAL) {
+            params = {};
+            params.flags = IORING_SETUP_CQSIZE;
+            params.cq_entries = RING_ENTRIES * 4;
+            ring_fd = uring_setup(RING_ENTRIES, &params);
+        }
+        if (ring_fd < 0) {
+            perror("io_uring_setup");
+            return false;
+        }
+
+        sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_len = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool const single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) {
+            sq_len = cq_len = std::max(sq_len, cq_len);
+        }
+        sq_ptr = mmap(nullptr, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+                      IORING_OFF_SQ_RING);
+        cq_ptr = single_mmap
+                     ? sq_ptr
+                     : mmap(nullptr, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+                            IORING_OFF_CQ_RING);
+        sqes_len = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe *>(mmap(nullptr, sqes_len, PROT_READ | PROT_WRITE,
+                                                MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES));
+        if (sq_ptr == MAP_FAILED || cq_ptr == MAP_FAILED || sqes == MAP_FAILED) {
+            perror("mmap");
+            return false;
+        }
+
+        auto *sq = static_cast<char *>(sq_ptr);
+        sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+        sq_mask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        sq_entries = params.sq_entries;
+        sq_local_tail = sq_submitted = *sq_tail;
+        auto *sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+        for (unsigned i = 0; i < sq_entries; ++i) {
+            sq_array[i] = i;
+        }
+
+        auto *cq = static_cast<char *>(cq_ptr);
+        cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+        cq_mask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+
+        setup_buffers();
+        return true;
+    }
+
+    void setup_buffers() {
+        buffers.resize(static_cast<std::size_t>(BUF_COUNT) * BUF_SIZE);
+        if (setup_buf_ring() && !probe_buf_ring()) {
+            // Some kernels accept the registration but never select from the ring
+            use_buf_ring = false;
+            io_uring_buf_reg reg{};
+            reg.bgid = BUF_GROUP;
+            uring_register(ring_fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+        }
+        if (!use_buf_ring) {
+            std::cerr << "io_uring: buffer ring unavailable, using IORING_OP_PROVIDE_BUFFERS" << std::endl;
+            io_uring_sqe *sqe = get_sqe(PROVIDE, BUF_COUNT);
+            sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+            sqe->addr = reinterpret_cast<std::uint64_t>(buffers.data());
+            sqe->len = BUF_SIZE;
+            sqe->buf_group = BUF_GROUP;
+            sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+        }
+    }
+
+    bool setup_buf_ring() {
+        buf_ring = static_cast<io_uring_buf_ring *>(mmap(nullptr, BUF_COUNT * sizeof(io_uring_buf),
+                                                         PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                                                         -1, 0));
+        if (buf_ring == MAP_FAILED) {
+            perror("mmap");
+            return false;
+        }
+        // Fault the pages in before the kernel pins them, otherwise it may pin the shared zero page
+        std::memset(buf_ring, 0, BUF_COUNT * sizeof(io_uring_buf));
+
+        io_uring_buf_reg reg{};
+        reg.ring_addr = reinterpret_cast<std::uint64_t>(buf_ring);
+        reg.ring_entries = BUF_COUNT;
+        reg.bgid = BUF_GROUP;
+        if (uring_register(ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+            perror("io_uring_register");
+            return false;
+        }
+
+        use_buf_ring = true;
+        for (unsigned bid = 0; bid < BUF_COUNT; ++bid) {
+            recycle_buffer(static_cast<unsigned short>(bid));
+        }
+        __atomic_store_n(&buf_ring->tail, buf_tail, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    // Receives one byte over a socketpair to check that the kernel really picks buffers from the ring
+    bool probe_buf_ring() {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+            return false;
+        }
+        char const byte = 0;
+        bool ok = write(sv[1], &byte, 1) == 1;
+        if (ok) {
+            io_uring_sqe *sqe = get_sqe(RECV, sv[0]);
+            sqe->opcode = IORING_OP_RECV;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = BUF_GROUP;
+            ok = submit(1) >= 0 && *cq_head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        }
+        if (ok) {
+            io_uring_cqe const cqe = cqes[*cq_head & *cq_mask];
+            __atomic_store_n(cq_head, *cq_head + 1, __ATOMIC_RELEASE);
+            ok = cqe.res == 1 && (cqe.flags & IORING_CQE_F_BUFFER);
+            if (ok) {
+                recycle_buffer(static_cast<unsigned short>(cqe.flags >> IORING_CQE_BUFFER_SHIFT));
+                __atomic_store_n(&buf_ring->tail, buf_tail, __ATOMIC_RELEASE);
+            }
+        }
+        close(sv[0]);
+        close(sv[1]);
+        return ok;
+    }
+
+    // With a buffer ring the new tail is published once per batch of completions,
+    // otherwise the buffer goes back through an IORING_OP_PROVIDE_BUFFERS request.
+    void recycle_buffer(unsigned short bid) {
+        char *addr = buffers.data() + static_cast<std::size_t>(bid) * BUF_SIZE;
+        if (!use_buf_ring) {
+            io_uring_sqe *sqe = get_sqe(PROVIDE, 1);
+            sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+            sqe->addr = reinterpret_cast<std::uint64_t>(addr);
+            sqe->len = BUF_SIZE;
+            sqe->off = bid;
+            sqe->buf_group = BUF_GROUP;
+            sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+            return;
+        }
+        io_uring_buf &buf = buf_ring->bufs[buf_tail & (BUF_COUNT - 1)];
+        buf.addr = reinterpret_cast<std::uint64_t>(addr);
+        buf.len = BUF_SIZE;
+        buf.bid = bid;
+        ++buf_tail;
+    }
+
+    int submit(unsigned wait_nr) {
+        __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+        int ret = uring_enter(ring_fd, sq_local_tail - sq_submitted, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+        if (ret > 0) {
+            sq_submitted += ret;
+        }
+        return ret;
+    }
+
+    io_uring_sqe *get_sqe(Op op, int fd, std::uint32_t generation = 0) {
+        if (sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+            submit(0);
+        }
+        io_uring_sqe *sqe = &sqes[sq_local_tail & *sq_mask];
+        ++sq_local_tail;
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqe->fd = fd;
+        sqe->user_data = static_cast<std::uint64_t>(generation) << 32 | static_cast<std::uint64_t>(fd) << 8 | op;
+        return sqe;
+    }
+
+    void arm_accept() {
+        io_uring_sqe *sqe = get_sqe(ACCEPT, listen_fd);
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_CLOEXEC;
+        accept_armed = true;
+    }
+
+    // The multishot accept is cancelled at the connection limit and armed again below it
+    void set_accepting(bool enable) {
+        accepting = enable;
+        if (enable && !accept_armed) {
+            arm_accept();
+        } else if (!enable) {
+            io_uring_sqe *sqe = get_sqe(CANCEL, listen_fd);
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = static_cast<std::uint64_t>(listen_fd) << 8 | ACCEPT;
+            sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+        }
+    }
+
+    // Accepting stops at the connection limit and, under the Pause policy, while overloaded
+    void update_accepting() {
+        bool const enable = (options.max_connections == 0 || active < options.max_connections)
+                            && !(options.shed_policy == ShedPolicy::Pause && admission.is_overloaded());
+        if (enable != accepting) {
+            set_accepting(enable);
+        }
+    }
+
+    void arm_timer() {
+        io_uring_sqe *sqe = get_sqe(TIMER, timer_fd);
+        sqe->opcode = IORING_OP_READ;
+        sqe->addr = reinterpret_cast<std::uint64_t>(&timer_expirations);
+        sqe->len = sizeof(timer_expirations);
+    }
+
+    // An expired connection is shut down, which completes its recv with EOF and sends it
+    // through the usual close path; a pending send fails and cancels the linked close.
+    void expire_timers() {
+        timers.advance(now, [this](TimerWheel::Node &timer) {
+            int const fd = ConnectionTable<Connection>::fd_of(timer.key);
+            Connection &c = *conns.find(fd, ConnectionTable<Connection>::generation_of(timer.key));
+            if (std::uint64_t const deadline = deadline_of(c); deadline > now) {
+                if (deadline != UINT64_MAX) {
+                    timers.schedule(timer, deadline);
+                }
+                return;
+            }
+            Metrics::add(Metrics::local().timeouts, 1);
+            pending_output -= c.output.size();
+            c.output.clear();
+            shutdown(fd, SHUT_RDWR);
+            // Without a recv there is no EOF completion to close the connection
+            if (!c.recv_armed) {
+                c.read_closed = true;
+                advance(fd, c);
+            }
+        });
+        arm_timer();
+    }
+
+    void arm_recv(int fd, Connection &c) {
+        io_uring_sqe *sqe = get_sqe(RECV, fd, c.generation);
+        sqe->opcode = IORING_OP_RECV;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = BUF_GROUP;
+        c.recv_armed = true;
+        c.recv_cancelled = false;
+    }
+
+    static std::size_t backlog_of(Connection const &c) {
+        return c.output.size() + c.in_flight.size();
+    }
+
+    // A client that does not read its replies is not read either: the multishot recv is
+    // cancelled, and the data already received still completes before the cancel does
+    void pause_recv(int fd, Connection &c) {
+        if (!c.recv_armed || c.recv_cancelled || c.read_closed || backlog_of(c) <= Stream::MAX_BACKLOG) {
+            return;
+        }
+        io_uring_sqe *sqe = get_sqe(CANCEL, fd, c.generation);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = static_cast<std::uint64_t>(c.generation) << 32 | static_cast<std::uint64_t>(fd) << 8 | RECV;
+        sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+        c.recv_cancelled = true;
+    }
+
+    void resume_recv(int fd, Connection &c) {
+        if (c.recv_armed || c.read_closed || c.closing || backlog_of(c) > Stream::MAX_BACKLOG) {
+            return;
+        }
+        arm_recv(fd, c);
+    }
+
+    void submit_close(int fd, Connection const &c) {
+        io_uring_sqe *sqe = get_sqe(CLOSE, fd, c.generation);
+        sqe->opcode = IORING_OP_CLOSE;
+    }
+
+    // Only one send per connection is in flight, so replies cannot be reordered.
+    // The final one is linked to the close and produces no completion on success,
+    // so only intermediate sends contribute to the write latency.
+    void submit_send(int fd, Connection &c, bool close_after) {
+        c.in_flight.swap(c.output);
+        c.output.clear();
+        c.sending = true;
+        c.send_started = Metrics::now_ns();
+        Metrics::add(Metrics::local().bytes_sent, c.in_flight.size());
+
+        io_uring_sqe *sqe = get_sqe(SEND, fd, c.generation);
+        sqe->opcode = IORING_OP_SEND;
+        sqe->addr = reinterpret_cast<std::uint64_t>(c.in_flight.data());
+        // The backlog stays near Stream::MAX_BACKLOG, far below the 32-bit length
+        sqe->len = static_cast<std::uint32_t>(c.in_flight.size());
+        sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+        if (close_after) {
+            sqe->flags = IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+            submit_close(fd, c);
+        }
+    }
+
+    void advance(int fd, Connection &c) {
+        if (c.sending || c.closing) {
+            return;
+        }
+        if (c.read_closed) {
+            c.closing = true;
+            if (c.output.empty()) {
+                submit_close(fd, c);
+            } else {
+                submit_send(fd, c, true);
+            }
+        } else if (!c.output.empty()) {
+            // Replies produced while a send is in flight go out together with the next one
+            submit_send(fd, c, false);
+        }
+    }
+
+    void handle_recv(io_uring_cqe const &cqe, int fd, Connection *conn, ReceiveCallback const &receive_callback) {
+        auto const bid = static_cast<unsigned short>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+        bool const has_buffer = cqe.flags & IORING_CQE_F_BUFFER;
+        if (conn == nullptr) {
+            if (has_buffer) recycle_buffer(bid);
+            return;
+        }
+
+        Connection &c = *conn;
+        std::size_t const queued = c.output.size();
+        auto emit = [&c](std::string out) { c.output.append(out); };
+        if (has_buffer) {
+            if (cqe.res > 0) {
+                Metrics::ThreadMetrics &metrics = Metrics::local();
+                if (c.awaiting_first_byte) {
+                    metrics.first_byte.record(Metrics::now_ns() - c.accepted_at);
+                    c.awaiting_first_byte = false;
+                }
+                Metrics::add(metrics.bytes_received, cqe.res);
+                c.last_activity = now;
+                char const *data = buffers.data() + static_cast<std::size_t>(bid) * BUF_SIZE;
+                c.request.feed(pool, {data, static_cast<std::size_t>(cqe.res)}, false, receive_callback, emit);
+            }
+            recycle_buffer(bid);
+        }
+
+        if (cqe.res == 0) {
+            c.request.feed(pool, {}, true, receive_callback, emit);
+            c.read_closed = true;
+        } else if (cqe.res < 0 && cqe.res != -ENOBUFS && cqe.res != -ECANCELED) {
+            errno = -cqe.res;
+            perror("recv");
+            Metrics::add(Metrics::local().errors, 1);
+            c.output.clear();
+            c.read_closed = true;
+        }
+        if (!(cqe.flags & IORING_CQE_F_MORE)) {
+            c.recv_armed = false;
+            resume_recv(fd, c);
+        }
+        pending_output = pending_output - queued + c.output.size();
+        advance(fd, c);
+        pause_recv(fd, c);
+    }
+
+    void handle_completion(io_uring_cqe const &cqe, ReceiveCallback const &receive_callback) {
+        auto const op = static_cast<Op>(cqe.user_data & 0xff);
+        auto const fd = static_cast<int>(cqe.user_data >> 8 & 0xffffff);
+        auto const generation = static_cast<std::uint32_t>(cqe.user_data >> 32);
+
+        switch (op) {
+            case ACCEPT:
+                if (cqe.res >= 0 && options.shed_policy == ShedPolicy::Reject && admission.is_overloaded()) {
+                    send(cqe.res, AdmissionControl::REJECT_MESSAGE, sizeof(AdmissionControl::REJECT_MESSAGE) - 1,
+                         MSG_DONTWAIT | MSG_NOSIGNAL);
+                    close(cqe.res);
+                    Metrics::add(Metrics::local().shed, 1);
+                } else if (cqe.res >= 0) {
+                    std::uint32_t const conn_generation = conns.open(cqe.res);
+                    Connection &c = *conns.find(cqe.res, conn_generation);
+                    c.generation = conn_generation;
+                    c.accepted_at = Metrics::now_ns();
+                    c.sending = c.read_closed = c.closing = false;
+                    c.awaiting_first_byte = true;
+                    c.last_activity = now;
+                    c.read_deadline = now + read_ticks;
+                    c.timer.key = ConnectionTable<Connection>::key(cqe.res, conn_generation);
+                    if (std::uint64_t const deadline = deadline_of(c); deadline != UINT64_MAX) {
+                        timers.schedule(c.timer, deadline);
+                    }
+                    Metrics::add(Metrics::local().accepted, 1);
+                    arm_recv(cqe.res, c);
+                    ++active;
+                    update_accepting();
+                }
+                if (!(cqe.flags & IORING_CQE_F_MORE)) {
+                    accept_armed = false;
+                    if (accepting) {
+                        arm_accept();
+                    }
+                }
+                break;
+            case RECV:
+                handle_recv(cqe, fd, conns.find(fd, generation), receive_callback);
+                break;
+            case SEND: {
+                Connection *conn = conns.find(fd, generation);
+                if (conn == nullptr) {
+                    break;
+                }
+                Connection &c = *conn;
+                c.sending = false;
+                pending_output -= c.in_flight.size();
+                c.in_flight.clear();
+                c.last_activity = now;
+                if (!c.closing) {
+                    Metrics::local().write.record(Metrics::now_ns() - c.send_started);
+                }
+                if (cqe.res < 0 && !c.closing) {
+                    Metrics::add(Metrics::local().errors, 1);
+                    pending_output -= c.output.size();
+                    c.output.clear();
+                    c.read_closed = true;
+                }
+                advance(fd, c);
+                resume_recv(fd, c);
+                break;
+            }
+            case CLOSE: {
+                if (cqe.res == -ECANCELED) {
+                    close(fd);
+                }
+                Connection *conn = conns.find(fd, generation);
+                if (conn != nullptr) {
+                    Metrics::add(Metrics::local().closed, 1);
+                    timers.cancel(conn->timer);
+                    pending_output -= conn->output.size() + conn->in_flight.size();
+                    conn->request.release(pool);
+                    conn->output.clear();
+                    conn->in_flight.clear();
+                    conns.close(fd);
+                    --active;
+                    update_accepting();
+                }
+                break;
+            }
+            case PROVIDE:
+                errno = -cqe.res;
+                perror("provide buffers");
+                break;
+            case TIMER:
+                expire_timers();
+                break;
+            case CANCEL:
+                break;
+        }
+    }
+
+public:
+    explicit UringConnectionsHandler(ServerOptions const &options)
+        : options(options), idle_ticks(ticks_of(options.idle_timeout_ms)), read_ticks(ticks_of(options.read_timeout_ms)),
+          listen_fd(Listener::open(options)),
+          timer_fd(timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)), timers(now_ticks()),
+          admission(options), now(now_ticks()) {
+        if (listen_fd < 0) {
+            return;
+        }
+
+        if (!setup_ring() && ring_fd >= 0) {
+            close(ring_fd);
+            ring_fd = -1;
+        }
+    }
+
+    void listen(ReceiveCallback const &receive_callback) {
+        if (ring_fd < 0) {
+            return;
+        }
+        std::cout << "listening on " << Listener::name_of(options) << " (io_uring)" << std::endl;
+
+        arm_accept();
+        // The tick also wakes an overloaded loop up to notice when the load is gone
+        if (idle_ticks > 0 || read_ticks > 0 || admission.enabled()) {
+            itimerspec const tick{
+                .it_interval = {.tv_sec = 0, .tv_nsec = TICK_MS * 1000000},
+                .it_value = {.tv_sec = 0, .tv_nsec = TICK_MS * 1000000},
+            };
+            timerfd_settime(timer_fd, 0, &tick, nullptr);
+            arm_timer();
+        }
+        while (true) {
+            if (submit(1) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                perror("io_uring_enter");
+                break;
+            }
+            std::uint64_t const started = Metrics::now_ns();
+            now = started / 1000000 / TICK_MS;
+            unsigned head = *cq_head;
+            unsigned const tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+            for (; head != tail; ++head) {
+                io_uring_cqe const cqe = cqes[head & *cq_mask];
+                handle_completion(cqe, receive_callback);
+            }
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+            if (use_buf_ring) {
+                __atomic_store_n(&buf_ring->tail, buf_tail, __ATOMIC_RELEASE);
+            }
+
+            std::uint64_t const busy = Metrics::now_ns() - started;
+            Metrics::local().loop.record(busy);
+            if (admission.enabled()) {
+                admission.update(busy, pending_output);
+                update_accepting();
+            }
+        }
+    }
+
+    ~UringConnectionsHandler() {
+        if (ring_fd >= 0) {
+            close(ring_fd);
+        }
+        if (buf_ring != MAP_FAILED) munmap(buf_ring, BUF_COUNT * sizeof(io_uring_buf));
+        if (sqes != MAP_FAILED) munmap(sqes, sqes_len);
+        if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) munmap(cq_ptr, cq_len);
+        if (sq_ptr != MAP_FAILED) munmap(sq_ptr, sq_len);
+        close(timer_fd);
+        close(listen_fd);
+    }
+};
+
+#endif //URINGCONNECTIONSHANDLER_H
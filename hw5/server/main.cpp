@@ -1,46 +1,188 @@
+#include <charconv>
 #include <iostream>
+#include <memory>
 #include <optional>
 #include <string>
-#include <sstream>
+#include <string_view>
+#include <vector>
+#include <csignal>
 
+#include "BatchEvaluator.h"
+#include "BinaryProtocol.h"
 #include "Calculator.h"
 #include "ConnectionsHandler.h"
+#include "ExpressionScanner.h"
+#include "Metrics.h"
+#include "MetricsReporter.h"
+#include "ResultCache.h"
+#include "ServerOptions.h"
+#include "UringConnectionsHandler.h"
 
 
+enum class Backend {
+    Epoll,
+    Uring
+};
+
 struct CommandLineArgs {
-    int port;
+    ServerOptions server;
+    Backend backend;
+    std::size_t cache_mb;
+    int admin_port;
 };
 
 std::pair<CommandLineArgs, std::optional<std::string>> parse_cla(int argc, char *argv[]) {
-    if (argc != 2) {
-        return {{}, ("Usage: " + std::string(argv[0]) + " <port>")};
+    if (argc < 2 || argc % 2 != 0) {
+        return {{}, ("Usage: " + std::string(argv[0]) + " <port|unix:path> [--backend epoll|uring] [--cache-mb <MiB>]"
+                                    " [--admin-port <port>] [--idle-timeout-ms <ms>] [--read-timeout-ms <ms>]"
+                                    " [--max-connections <n>] [--max-loop-lag-ms <ms>] [--max-pending-output <bytes>]"
+                                    " [--shed-policy pause|reject] [--backlog <n>] [--defer-accept-s <s>]")};
+    }
+
+    ServerOptions server;
+    if (std::string_view const address = argv[1]; address.rfind("unix:", 0) == 0) {
+        server.unix_path = address.substr(5);
+    } else {
+        server.port = atoi(argv[1]);
     }
+    Backend backend = Backend::Epoll;
+    long cache_mb = 0;
+    int admin_port = 0;
 
-    int port = atoi(argv[1]);
+    for (int i = 2; i < argc; i += 2) {
+        std::string const option = argv[i], value = argv[i + 1];
+        if (option == "--backend" && value == "epoll") {
+            backend = Backend::Epoll;
+        } else if (option == "--backend" && value == "uring") {
+            backend = Backend::Uring;
+        } else if (option == "--cache-mb") {
+            cache_mb = std::atol(value.c_str());
+        } else if (option == "--admin-port") {
+            admin_port = atoi(value.c_str());
+            if (admin_port <= 0) {
+                return {{}, {"Invalid arguments"}};
+            }
+        } else if (option == "--idle-timeout-ms" && std::atol(value.c_str()) >= 0) {
+            server.idle_timeout_ms = static_cast<unsigned>(std::atol(value.c_str()));
+        } else if (option == "--read-timeout-ms" && std::atol(value.c_str()) >= 0) {
+            server.read_timeout_ms = static_cast<unsigned>(std::atol(value.c_str()));
+        } else if (option == "--max-connections" && std::atol(value.c_str()) >= 0) {
+            server.max_connections = static_cast<std::size_t>(std::atol(value.c_str()));
+        } else if (option == "--max-loop-lag-ms" && std::atol(value.c_str()) >= 0) {
+            server.max_loop_lag_ms = static_cast<unsigned>(std::atol(value.c_str()));
+        } else if (option == "--max-pending-output" && std::atol(value.c_str()) >= 0) {
+            server.max_pending_output = static_cast<std::size_t>(std::atol(value.c_str()));
+        } else if (option == "--shed-policy" && value == "pause") {
+            server.shed_policy = ShedPolicy::Pause;
+        } else if (option == "--shed-policy" && value == "reject") {
+            server.shed_policy = ShedPolicy::Reject;
+        } else if (option == "--backlog" && std::atol(value.c_str()) > 0) {
+            server.backlog = atoi(value.c_str());
+        } else if (option == "--defer-accept-s" && std::atol(value.c_str()) >= 0) {
+            server.defer_accept_s = static_cast<unsigned>(std::atol(value.c_str()));
+        } else {
+            return {{}, {"Invalid arguments"}};
+        }
+    }
 
-    if (port <= 0) {
+    if ((server.port <= 0 && server.unix_path.empty()) || cache_mb < 0) {
         return {{}, {"Invalid arguments"}};
     }
 
-    return {CommandLineArgs{.port = port}, std::nullopt};
+    return {CommandLineArgs{
+        .server = server,
+        .backend = backend,
+        .cache_mb = static_cast<std::size_t>(cache_mb),
+        .admin_port = admin_port
+    }, std::nullopt};
 }
 
 
-std::string calculate(std::string const& data) {
-    std::ostringstream oss;
-    std::istringstream iss(data);
-    std::string token;
-    bool first = true;
-    while (iss >> token) {
-        long res = Calculator::evaluate(token);
-        if (!first) {
-            oss << ' ';
+// Expressions the scanner could not tokenize are evaluated from their text
+long evaluate_tokens(std::string_view text, ExpressionScanner::Token const *tokens, std::size_t count) {
+    if (count == 0) {
+        return Calculator::evaluate(std::string(text));
+    }
+    Calculator::Accumulator acc;
+    for (std::size_t i = 0; i < count; ++i) {
+        acc.apply(tokens[i].op, tokens[i].operand);
+    }
+    return acc.value();
+}
+
+std::string calculate_binary(std::string_view data) {
+    thread_local BatchEvaluator batch;
+    thread_local std::vector<ExpressionScanner::Token> tokens;
+    thread_local std::vector<long> results;
+    results.clear();
+    auto store = [](std::size_t index, long value) { results[index] = value; };
+
+    BinaryProtocol::for_each_frame(data, [&store](std::string_view payload) {
+        tokens.clear();
+        bool const ok = BinaryProtocol::decode(payload, [](char op, long num) {
+            tokens.push_back({num, op});
+        });
+        std::size_t const index = results.size();
+        results.push_back(BinaryProtocol::ERROR_RESULT);
+        if (ok && !batch.add(tokens.data(), tokens.size(), index, store)) {
+            results[index] = evaluate_tokens({}, tokens.data(), tokens.size());
         }
-        oss << res;
-        first = false;
+    });
+    batch.flush(store);
+
+    std::string out;
+    for (long const res: results) {
+        BinaryProtocol::append_result(out, res);
+    }
+    return out;
+}
+
+// Expressions are scanned first and evaluated in batches of equal length, so results are
+// collected by index and printed at the end. The cache is keyed by the expression text,
+// which the scanner has already stripped of whitespace.
+std::string calculate(std::string_view data, Protocol protocol, ResultCache *cache) {
+    if (protocol == Protocol::Binary) {
+        return calculate_binary(data);
     }
 
-    return oss.str();
+    thread_local ExpressionScanner scanner;
+    thread_local BatchEvaluator batch;
+    thread_local std::vector<long> results;
+    thread_local std::vector<std::pair<std::size_t, std::string_view>> misses;
+    results.clear();
+    misses.clear();
+    auto store = [](std::size_t index, long value) { results[index] = value; };
+
+    scanner.scan(data, [cache, &store](std::string_view text, ExpressionScanner::Token const *tokens,
+                                       std::size_t count) {
+        std::size_t const index = results.size();
+        results.push_back(0);
+        if (cache != nullptr) {
+            if (auto const cached = cache->find(text)) {
+                results[index] = cached.value();
+                return;
+            }
+            misses.emplace_back(index, text);
+        }
+        if (!batch.add(tokens, count, index, store)) {
+            results[index] = evaluate_tokens(text, tokens, count);
+        }
+    });
+    batch.flush(store);
+
+    for (auto const &[index, text]: misses) {
+        cache->insert(text, results[index]);
+    }
+
+    std::string out;
+    for (long const res: results) {
+        if (!out.empty()) {
+            out.push_back(' ');
+        }
+        char buf[24];
+        out.append(buf, std::to_chars(buf, buf + sizeof(buf), res).ptr);
+    }
+    return out;
 }
 
 int main(int argc, char *argv[]) {
@@ -51,9 +193,41 @@ int main(int argc, char *argv[]) {
         return EXIT_FAILURE;
     }
 
-    ConnectionsHandler connections_handler(args.port);
+    signal(SIGPIPE, SIG_IGN);
+
+    std::unique_ptr<ResultCache> cache;
+    if (args.cache_mb > 0) {
+        cache = std::make_unique<ResultCache>(args.cache_mb << 20);
+        Metrics::add_collector([cache = cache.get()](std::ostream &os) {
+            ResultCache::Stats const stats = cache->stats();
+            os << "# TYPE calc_cache_hits_total counter\ncalc_cache_hits_total " << stats.hits << '\n'
+                    << "# TYPE calc_cache_misses_total counter\ncalc_cache_misses_total " << stats.misses << '\n'
+                    << "# TYPE calc_cache_evictions_total counter\ncalc_cache_evictions_total "
+                    << stats.evictions << '\n'
+                    << "# TYPE calc_cache_entries gauge\ncalc_cache_entries " << stats.entries << '\n'
+                    << "# TYPE calc_cache_capacity gauge\ncalc_cache_capacity " << stats.capacity << '\n';
+        });
+    }
+    MetricsReporter metrics_reporter(args.admin_port);
+
+    auto receive_callback = [&cache](std::string_view data, Protocol protocol) {
+        Metrics::ThreadMetrics &metrics = Metrics::local();
+        std::uint64_t const started = Metrics::now_ns();
+        std::string out = calculate(data, protocol, cache.get());
+        metrics.evaluation.record(Metrics::now_ns() - started);
+        Metrics::add(metrics.requests, 1);
+        return out;
+    };
 
-    connections_handler.listen(calculate);
+    if (args.backend == Backend::Uring) {
+        UringConnectionsHandler connections_handler(args.server);
+
+        connections_handler.listen(receive_callback);
+    } else {
+        ConnectionsHandler connections_handler(args.server);
+
+        connections_handler.listen(receive_callback);
+    }
 
     return EXIT_SUCCESS;
 }
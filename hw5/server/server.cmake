@@ -2,17 +2,36 @@ cmake_minimum_required(VERSION 3.22)
 
 project(hw2)
 
-SET(CMAKE_CXX_STANDARD 17)
-SET(CMAKE_CXX_STANDARD_REQUIRED ON)
-SET(CMAKE_CXX_EXTENSIONS OFF)
-
 SET(SOURCE_FILES
         server/main.cpp
+        server/AdmissionControl.h
+        server/BatchEvaluator.h
+        server/BinaryProtocol.h
+        server/BufferPool.h
         server/Calculator.h
+        server/ConnectionTable.h
         server/ConnectionsHandler.h
+        server/ExpressionScanner.h
+        server/FramePool.h
+        server/Handler.h
+        server/Listener.h
+        server/Metrics.h
+        server/MetricsReporter.h
+        server/OutputQueue.h
+        server/ResultCache.h
+        server/RequestAssembler.h
+        server/ServerOptions.h
+        server/Stream.h
+        server/TimerWheel.h
+        server/UringConnectionsHandler.h
 )
 
+find_package(Threads REQUIRED)
+
 add_executable(server ${SOURCE_FILES})
+# Handlers are C++20 coroutines; the other targets stay on the top-level standard
+target_compile_features(server PRIVATE cxx_std_20)
+target_link_libraries(server PRIVATE Threads::Threads)
 
 if (CMAKE_BUILD_TYPE MATCHES Debug)
     target_compile_options(server PRIVATE -g -O0 -Wall -Wextra -Werror)